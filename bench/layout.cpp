@@ -0,0 +1,177 @@
+/**
+ * @brief Check and time the chunk mapping kernels of layout.hpp
+ *
+ * Every fixed<> kernel for 3 to 10 members and 32 KiB to 2 MiB chunks is
+ * compared against the generic mapping, as is the kernel select() picks for
+ * 2 to 10 members. Then the split of a sequential pass is timed for the
+ * geometries select() specializes.
+ *
+ * Exits with 1 on the first mismatch.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <chrono>
+
+#include <cstdint>
+#include <cstdlib>
+
+#include <raidfuse/layout.hpp>
+
+namespace {
+
+using namespace raidfuse;
+
+/**
+ * @brief Geometry with its stripe offset table, as raid5::calculate() builds it
+ */
+struct array_t
+{
+	std::vector<size_t> offset;
+	layout::geometry_t geometry;
+
+	array_t(size_t count, size_t stripe_lba)
+	{
+		size_t sequence = count * count;
+		size_t value = 0;
+		for (size_t stripe = 0; stripe < sequence; stripe++)
+		{
+			if (stripe % count == count - (stripe / count) % count - 1)
+			{
+				value++;
+			}
+			else
+			{
+				offset.push_back(value);
+			}
+		}
+
+		geometry.count = count;
+		geometry.stripe_lba = stripe_lba;
+		geometry.logical_sequence = sequence - count;
+		geometry.offset = offset.data();
+	}
+};
+
+bool compare(const array_t &array, const layout::kernel_t &kernel, const char *name)
+{
+	const layout::geometry_t &geometry = array.geometry;
+	size_t chunks = 4 * geometry.logical_sequence;
+
+	for (size_t chunk = 0; chunk < chunks; chunk++)
+	{
+		/* Also far behind the start, rows of a 16 TiB member */
+		for (size_t base: { (size_t)0, ((size_t)1 << 44) / geometry.stripe_lba * (geometry.count - 1) })
+		{
+			size_t drive, row, expected_drive, expected_row;
+			kernel.map(geometry, base + chunk, drive, row);
+			layout::generic::map(geometry, base + chunk, expected_drive, expected_row);
+			if ((drive != expected_drive) || (row != expected_row))
+			{
+				std::cerr << name << ": " << geometry.count << " members, chunk " << geometry.stripe_lba * 512 / 1024 << " KiB: "
+					<< "map of chunk " << base + chunk << " is " << drive << "/" << row
+					<< ", expected " << expected_drive << "/" << expected_row << std::endl;
+				return false;
+			}
+
+			for (size_t index: { (size_t)0, (size_t)1, geometry.stripe_lba - 1 })
+			{
+				size_t lba = (base + chunk) * geometry.stripe_lba + index;
+				size_t member_lba, expected_lba;
+				size_t left = kernel.split(geometry, lba, drive, member_lba);
+				size_t expected_left = layout::generic::split(geometry, lba, expected_drive, expected_lba);
+				if ((drive != expected_drive) || (member_lba != expected_lba) || (left != expected_left))
+				{
+					std::cerr << name << ": " << geometry.count << " members, chunk " << geometry.stripe_lba * 512 / 1024 << " KiB: "
+						<< "split of LBA " << lba << " is " << drive << "/" << member_lba << "/" << left
+						<< ", expected " << expected_drive << "/" << expected_lba << "/" << expected_left << std::endl;
+					return false;
+				}
+			}
+		}
+	}
+	return true;
+}
+
+template <size_t Count, size_t StripeLba>
+bool check_fixed()
+{
+	layout::kernel_t kernel = { &layout::fixed<Count, StripeLba>::map, &layout::fixed<Count, StripeLba>::split, true };
+	return compare(array_t(Count, StripeLba), kernel, "fixed");
+}
+
+/* 32 KiB to 2 MiB chunks */
+template <size_t Count>
+bool check_count()
+{
+	return
+		check_fixed<Count, 64>() &&
+		check_fixed<Count, 128>() &&
+		check_fixed<Count, 256>() &&
+		check_fixed<Count, 512>() &&
+		check_fixed<Count, 1024>() &&
+		check_fixed<Count, 2048>() &&
+		check_fixed<Count, 4096>();
+}
+
+bool check_select()
+{
+	for (size_t count = 2; count <= 10; count++)
+	{
+		for (size_t stripe_lba = 64; stripe_lba <= 4096; stripe_lba *= 2)
+		{
+			if (!compare(array_t(count, stripe_lba), layout::select(count, stripe_lba), "select"))
+			{
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+/**
+ * @return nanoseconds per split of a sequential pass over 16 GiB, in 4 KiB requests
+ */
+double measure(const layout::geometry_t &geometry, layout::split_t split, size_t &checksum)
+{
+	size_t lbas = (size_t)16 * 1024 * 1024 * 1024 / 512;
+	auto begin = std::chrono::steady_clock::now();
+	for (size_t lba = 0; lba < lbas; lba += 8)
+	{
+		size_t drive, member_lba;
+		checksum += split(geometry, lba, drive, member_lba) + drive + member_lba;
+	}
+	return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count() / (lbas / 8);
+}
+
+}
+
+int main()
+{
+	if (!check_count<3>() || !check_count<4>() || !check_count<5>() || !check_count<6>() ||
+		!check_count<7>() || !check_count<8>() || !check_count<9>() || !check_count<10>() ||
+		!check_select())
+	{
+		return 1;
+	}
+	std::cout << "fixed and selected kernels match generic mapping" << std::endl;
+
+	size_t checksum = 0;
+	std::cout << "members  chunk     generic   specialized  (ns per split)" << std::endl;
+	for (size_t count = 3; count <= 8; count++)
+	{
+		for (size_t stripe_lba = 128; stripe_lba <= 2048; stripe_lba *= 2)
+		{
+			array_t array(count, stripe_lba);
+			double generic = measure(array.geometry, &layout::generic::split, checksum);
+			double specialized = measure(array.geometry, layout::select(count, stripe_lba).split, checksum);
+			std::cout << std::setw(7) << count << std::setw(6) << stripe_lba / 2 << " KiB"
+				<< std::fixed << std::setprecision(2) << std::setw(12) << generic << std::setw(14) << specialized << std::endl;
+		}
+	}
+
+	/* Keeps the passes from being optimized away */
+	asm volatile("" : : "r"(checksum));
+	return 0;
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+
+namespace raidfuse {
+
+/**
+ * @brief Limit concurrent requests, waiting groups are admitted in turn
+ *
+ * Requests of a group, e.g. an array, pass immediately while slots are
+ * free. Once all slots are taken, each released slot goes to the next group
+ * with waiting requests, so a group with many readers can not starve one
+ * with few.
+ */
+class admission
+{
+	public:
+		/**
+		 * @brief Slot held for the lifetime of the ticket
+		 */
+		class ticket
+		{
+			public:
+				ticket(admission &owner, size_t group):
+					m_owner(owner)
+				{
+					m_owner.enter(group);
+				}
+
+				ticket(const ticket &) = delete;
+				ticket &operator=(const ticket &) = delete;
+
+				~ticket()
+				{
+					m_owner.leave();
+				}
+
+			protected:
+				admission &m_owner;
+		};
+
+		/**
+		 * @param slots concurrent requests, 0 for no limit
+		 */
+		admission(size_t slots = 0):
+			m_slots(slots),
+			m_active(0),
+			m_waiting(0),
+			m_next(0)
+		{
+
+		}
+
+		admission(const admission &) = delete;
+		admission &operator=(const admission &) = delete;
+
+		void slots(size_t slots)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_slots = slots;
+		}
+
+		void enter(size_t group)
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+
+			if (!m_slots || ((m_active < m_slots) && !m_waiting))
+			{
+				m_active++;
+				return;
+			}
+
+			if (group >= m_groups.size())
+			{
+				m_groups.resize(group + 1);
+			}
+			m_groups[group].waiting++;
+			m_waiting++;
+
+			m_condition.wait(lock, [this, group] { return m_groups[group].granted > 0; });
+			m_groups[group].granted--;
+		}
+
+		void leave()
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+
+			/* Hand slot over to the next waiting group */
+			for (size_t step = 0; m_waiting && (step < m_groups.size()); step++)
+			{
+				group_t &group = m_groups[m_next++ % m_groups.size()];
+				if (group.waiting)
+				{
+					group.waiting--;
+					group.granted++;
+					m_waiting--;
+					m_condition.notify_all();
+					return;
+				}
+			}
+			m_active--;
+		}
+
+	protected:
+		struct group_t
+		{
+			size_t waiting = 0;
+			size_t granted = 0;
+		};
+
+		size_t m_slots;
+		size_t m_active;
+		size_t m_waiting;
+		size_t m_next;
+		std::vector<group_t> m_groups;
+		std::mutex m_mutex;
+		std::condition_variable m_condition;
+};
+
+}
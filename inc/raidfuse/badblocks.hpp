@@ -0,0 +1,176 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <map>
+#include <iterator>
+#include <algorithm>
+#include <mutex>
+#include <atomic>
+#include <stdexcept>
+
+#include <unistd.h>
+
+namespace raidfuse {
+
+/**
+ * @brief Unreadable sector ranges per member
+ *
+ * Optionally persisted as text file with one "member lba count" line per
+ * range, new ranges are appended and synced immediately.
+ */
+class badblocks
+{
+	public:
+		badblocks():
+			m_file(nullptr),
+			m_count(0)
+		{
+
+		}
+
+		badblocks(const badblocks &) = delete;
+		badblocks &operator=(const badblocks &) = delete;
+
+		~badblocks()
+		{
+			if (m_file)
+			{
+				fclose(m_file);
+			}
+		}
+
+		/**
+		 * @brief Load ranges from file and append new ones to it
+		 */
+		void open(const std::string &filename)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+
+			FILE *file = fopen(filename.c_str(), "a+");
+			if (!file)
+			{
+				throw std::runtime_error("Error opening bad block list '" + filename + "'");
+			}
+
+			rewind(file);
+			unsigned long long member, lba, count;
+			while (fscanf(file, "%llu %llu %llu", &member, &lba, &count) == 3)
+			{
+				insert(member, lba, count);
+			}
+
+			if (m_file)
+			{
+				fclose(m_file);
+			}
+			m_file = file;
+		}
+
+		/**
+		 * @brief Number of recorded ranges
+		 */
+		size_t count() const
+		{
+			return m_count.load(std::memory_order_acquire);
+		}
+
+		void add(size_t member, size_t lba, size_t count)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+
+			insert(member, lba, count);
+
+			if (m_file)
+			{
+				fprintf(m_file, "%zu %zu %zu\n", member, lba, count);
+				fflush(m_file);
+				fdatasync(fileno(m_file));
+			}
+		}
+
+		/**
+		 * @brief First bad range of member intersecting [first, last)
+		 * @param lba start of intersection
+		 * @param count length of intersection
+		 * @return false, if range is clean
+		 */
+		bool next(size_t member, size_t first, size_t last, size_t &lba, size_t &count)
+		{
+			if (!this->count())
+			{
+				return false;
+			}
+
+			std::lock_guard<std::mutex> lock(m_mutex);
+			return find(member, first, last, lba, count);
+		}
+
+	protected:
+		/**
+		 * @brief Non overlapping ranges start -> end per member
+		 */
+		std::vector< std::map<size_t, size_t> > m_ranges;
+		FILE *m_file;
+		std::atomic<size_t> m_count;
+		std::mutex m_mutex;
+
+		void insert(size_t member, size_t lba, size_t count)
+		{
+			if (member >= m_ranges.size())
+			{
+				m_ranges.resize(member + 1);
+			}
+			std::map<size_t, size_t> &ranges = m_ranges[member];
+
+			size_t first = lba;
+			size_t last = lba + count;
+
+			/* Merge with overlapping or adjacent ranges */
+			auto item = ranges.upper_bound(first);
+			if ((item != ranges.begin()) && (std::prev(item)->second >= first))
+			{
+				--item;
+			}
+			while ((item != ranges.end()) && (item->first <= last))
+			{
+				first = std::min(first, item->first);
+				last = std::max(last, item->second);
+				item = ranges.erase(item);
+			}
+			ranges[first] = last;
+
+			size_t total = 0;
+			for (const std::map<size_t, size_t> &member_ranges: m_ranges)
+			{
+				total += member_ranges.size();
+			}
+			m_count.store(total, std::memory_order_release);
+		}
+
+		bool find(size_t member, size_t first, size_t last, size_t &lba, size_t &count) const
+		{
+			if (member >= m_ranges.size())
+			{
+				return false;
+			}
+			const std::map<size_t, size_t> &ranges = m_ranges[member];
+
+			auto item = ranges.upper_bound(first);
+			if ((item != ranges.begin()) && (std::prev(item)->second > first))
+			{
+				--item;
+			}
+			if ((item == ranges.end()) || (item->first >= last))
+			{
+				return false;
+			}
+
+			lba = std::max(first, item->first);
+			count = std::min(last, item->second) - lba;
+			return true;
+		}
+};
+
+}
@@ -0,0 +1,695 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <stdexcept>
+
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+namespace raidfuse {
+
+/**
+ * @brief Memory limit shared by several buffer pools, 0 for no limit
+ *
+ * A pool which cannot allocate within the limit first takes idle memory
+ * back from the other pools, then waits for any pool to give memory or a
+ * buffer back.
+ */
+class budget
+{
+	public:
+		/**
+		 * @brief Holder of memory charged to the budget
+		 */
+		class client
+		{
+			public:
+				virtual ~client() {}
+
+				/**
+				 * @brief Give idle memory back to the budget
+				 * @param bytes memory wanted
+				 * @return memory given back, may be more or less than wanted
+				 */
+				virtual size_t trim(size_t bytes) = 0;
+		};
+
+		budget(size_t limit = 0):
+			m_limit(limit),
+			m_used(0),
+			m_timeout(std::chrono::seconds(1)),
+			m_generation(0),
+			m_waiting(0)
+		{
+
+		}
+
+		budget(const budget &) = delete;
+		budget &operator=(const budget &) = delete;
+
+		void limit(size_t bytes) { m_limit = bytes; }
+		size_t limit() const { return m_limit; }
+		size_t used() const { return m_used; }
+
+		/**
+		 * @brief Longest wait for a release, before an allocation fails
+		 */
+		void timeout(std::chrono::milliseconds timeout) { m_timeout = timeout; }
+		std::chrono::milliseconds timeout() const { return m_timeout; }
+
+		/**
+		 * @return false, if bytes do not fit into the limit
+		 */
+		bool reserve(size_t bytes)
+		{
+			size_t used = m_used.load(std::memory_order_relaxed);
+			do
+			{
+				size_t limit = m_limit.load(std::memory_order_relaxed);
+				if (limit && (used + bytes > limit))
+				{
+					return false;
+				}
+			}
+			while (!m_used.compare_exchange_weak(used, used + bytes, std::memory_order_relaxed));
+			return true;
+		}
+
+		void release(size_t bytes)
+		{
+			m_used.fetch_sub(bytes, std::memory_order_relaxed);
+			wake();
+		}
+
+		/**
+		 * @brief Count of releases so far, taken before trying to allocate
+		 */
+		size_t generation() const { return m_generation; }
+
+		/**
+		 * @brief Wake waiting pools, a buffer was given back
+		 */
+		void wake()
+		{
+			m_generation++;
+			if (m_waiting)
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_condition.notify_all();
+			}
+		}
+
+		/**
+		 * @brief Wait for release after generation
+		 * @return false on timeout
+		 */
+		bool wait(size_t generation, std::chrono::steady_clock::time_point deadline)
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_waiting++;
+			bool result = m_condition.wait_until(lock, deadline, [&] { return m_generation != generation; });
+			m_waiting--;
+			return result;
+		}
+
+		void attach(client *item)
+		{
+			std::lock_guard<std::mutex> lock(m_clients_mutex);
+			m_clients.push_back(item);
+		}
+
+		/**
+		 * @brief Detach client, waits for a reclaim() trimming it
+		 */
+		void detach(client *item)
+		{
+			std::lock_guard<std::mutex> lock(m_clients_mutex);
+			m_clients.erase(std::remove(m_clients.begin(), m_clients.end(), item), m_clients.end());
+		}
+
+		/**
+		 * @brief Take idle memory back from clients other than the requester
+		 * @return memory given back
+		 */
+		size_t reclaim(size_t bytes, client *requester)
+		{
+			std::lock_guard<std::mutex> lock(m_clients_mutex);
+			size_t result = 0;
+			for (client *item: m_clients)
+			{
+				if (result >= bytes)
+				{
+					break;
+				}
+				if (item != requester)
+				{
+					result += item->trim(bytes - result);
+				}
+			}
+			return result;
+		}
+
+	protected:
+		std::atomic<size_t> m_limit;
+		std::atomic<size_t> m_used;
+		std::chrono::milliseconds m_timeout;
+		std::atomic<size_t> m_generation;
+		std::atomic<size_t> m_waiting;
+		std::mutex m_mutex;
+		std::condition_variable m_condition;
+		std::vector<client *> m_clients;
+		std::mutex m_clients_mutex;
+};
+
+/**
+ * @brief Pool of equally sized, page aligned buffers
+ *
+ * Buffers are carved from 2 MiB aligned slabs, optionally backed by
+ * explicit or transparent huge pages, and are returned to the system when
+ * the pool is destroyed or trimmed.
+ * Free buffers are kept in a few shards; each thread prefers its own
+ * shard, so concurrent readers rarely share a lock. All buffers are
+ * suitable for O_DIRECT, regions() lists the slabs for registration with
+ * io_uring.
+ * Slabs are charged to an optional shared budget. Once no slab fits, the
+ * pool trims slabs of other pools whose buffers are all free, so a pool
+ * which grew first does not starve the others. Once nothing is left to
+ * trim, buffers are mapped one by one and unmapped again on release,
+ * charged to the budget as well. Once not even a buffer fits, allocate()
+ * waits for a release and throws std::bad_alloc if none comes in time, so
+ * the memory kept by all pools stays within the budget. try_allocate()
+ * returns an empty buffer instead.
+ */
+class buffer_pool:
+	public budget::client
+{
+	public:
+		static constexpr size_t page_size = 4096;
+		static constexpr size_t slab_size = 2 * 1024 * 1024;
+		static constexpr size_t shards = 8;
+
+		struct stats_t
+		{
+			size_t allocations;
+			size_t slabs;
+			size_t bytes;
+			size_t huge_bytes;
+			size_t in_use;
+			size_t high_water;
+			size_t transient;
+		};
+
+		/**
+		 * @brief Buffer handle, gives buffer back to its pool on destruction
+		 */
+		class buffer
+		{
+			public:
+				buffer():
+					m_pool(nullptr),
+					m_data(nullptr),
+					m_transient(false)
+				{
+
+				}
+
+				buffer(buffer_pool *pool, std::uint8_t *data, bool transient = false):
+					m_pool(pool),
+					m_data(data),
+					m_transient(transient)
+				{
+
+				}
+
+				buffer(buffer &&other):
+					m_pool(other.m_pool),
+					m_data(other.m_data),
+					m_transient(other.m_transient)
+				{
+					other.m_data = nullptr;
+				}
+
+				buffer &operator=(buffer &&other)
+				{
+					std::swap(m_pool, other.m_pool);
+					std::swap(m_data, other.m_data);
+					std::swap(m_transient, other.m_transient);
+					return *this;
+				}
+
+				buffer(const buffer &) = delete;
+				buffer &operator=(const buffer &) = delete;
+
+				~buffer()
+				{
+					if (m_data)
+					{
+						m_pool->release(m_data, m_transient);
+					}
+				}
+
+				std::uint8_t *data() const { return m_data; }
+				size_t size() const { return m_pool ? m_pool->buffer_size() : 0; }
+
+			protected:
+				buffer_pool *m_pool;
+				std::uint8_t *m_data;
+				bool m_transient;
+		};
+
+		buffer_pool(size_t buffer_size, bool hugepages = false):
+			m_buffer_size((std::max(buffer_size, (size_t)1) + page_size - 1) / page_size * page_size),
+			m_hugepages(hugepages),
+			m_allocations(0),
+			m_in_use(0),
+			m_high_water(0),
+			m_transient(0),
+			m_huge_bytes(0),
+			m_budget(nullptr),
+			m_charged(0)
+		{
+
+		}
+
+		buffer_pool(const buffer_pool &) = delete;
+		buffer_pool &operator=(const buffer_pool &) = delete;
+
+		~buffer_pool()
+		{
+			if (m_budget)
+			{
+				m_budget->detach(this);
+			}
+			for (const slab_t &slab: m_slabs)
+			{
+				munmap(slab.region.iov_base, slab.region.iov_len);
+			}
+			if (m_budget)
+			{
+				m_budget->release(m_charged);
+			}
+		}
+
+		size_t buffer_size() const { return m_buffer_size; }
+
+		/**
+		 * @brief Back slabs allocated from now on with 2 MiB huge pages
+		 *
+		 * Falls back to transparent huge pages when no huge pages are reserved.
+		 */
+		void hugepages(bool enable)
+		{
+			m_hugepages = enable;
+		}
+
+		/**
+		 * @brief Charge slabs to shared budget, to be set before the first allocation
+		 */
+		void budget(raidfuse::budget *shared)
+		{
+			m_budget = shared;
+			m_budget->attach(this);
+		}
+
+		/**
+		 * @brief Preallocate buffers, e.g. before registering regions()
+		 */
+		void reserve(size_t count)
+		{
+			std::vector<buffer> items;
+			for (size_t index = 0; index < count; index++)
+			{
+				items.push_back(allocate());
+			}
+		}
+
+		/**
+		 * @throw std::bad_alloc if no buffer fits into the budget in time
+		 */
+		buffer allocate()
+		{
+			buffer result = try_allocate();
+			if (!result.data())
+			{
+				throw std::bad_alloc();
+			}
+			return result;
+		}
+
+		/**
+		 * @brief Allocate without throwing, for paths which can report the failure
+		 * @return empty buffer if no buffer fits into the budget in time
+		 */
+		buffer try_allocate()
+		{
+			m_allocations.fetch_add(1, std::memory_order_relaxed);
+
+			size_t in_use = m_in_use.fetch_add(1, std::memory_order_relaxed) + 1;
+			size_t high_water = m_high_water.load(std::memory_order_relaxed);
+			while ((in_use > high_water) && !m_high_water.compare_exchange_weak(high_water, in_use, std::memory_order_relaxed))
+			{
+
+			}
+
+			size_t home = shard();
+			std::uint8_t *data = take(home);
+			if (data)
+			{
+				return buffer(this, data);
+			}
+
+			size_t length = slab_length();
+			if (!m_budget || m_budget->reserve(length))
+			{
+				return buffer(this, grow(home, length));
+			}
+
+			auto deadline = std::chrono::steady_clock::now() + m_budget->timeout();
+			for (;;)
+			{
+				size_t generation = m_budget->generation();
+
+				data = take(home);
+				if (data)
+				{
+					return buffer(this, data);
+				}
+				if (m_budget->reserve(length))
+				{
+					return buffer(this, grow(home, length));
+				}
+				if (m_budget->reclaim(length, this))
+				{
+					continue;
+				}
+				if (m_budget->reserve(m_buffer_size))
+				{
+					return buffer(this, transient(), true);
+				}
+
+				if (!m_budget->wait(generation, deadline))
+				{
+					m_in_use.fetch_sub(1, std::memory_order_relaxed);
+					return buffer();
+				}
+			}
+		}
+
+		/**
+		 * @brief Memory regions of all slabs
+		 */
+		std::vector<iovec> regions()
+		{
+			std::lock_guard<std::mutex> lock(m_slab_mutex);
+			std::vector<iovec> result;
+			for (const slab_t &slab: m_slabs)
+			{
+				result.push_back(slab.region);
+			}
+			return result;
+		}
+
+		stats_t stats()
+		{
+			std::lock_guard<std::mutex> lock(m_slab_mutex);
+
+			stats_t result;
+			result.allocations = m_allocations;
+			result.slabs = m_slabs.size();
+			result.bytes = 0;
+			for (const slab_t &slab: m_slabs)
+			{
+				result.bytes += slab.region.iov_len;
+			}
+			result.huge_bytes = m_huge_bytes;
+			result.in_use = m_in_use;
+			result.high_water = m_high_water;
+			result.transient = m_transient;
+			return result;
+		}
+
+		/**
+		 * @brief Unmap slabs whose buffers are all free, and give them back to the budget
+		 */
+		virtual size_t trim(size_t bytes)
+		{
+			std::vector<slab_t> idle;
+			{
+				std::lock_guard<std::mutex> slab_lock(m_slab_mutex);
+				std::unique_lock<std::mutex> locks[shards];
+				for (size_t index = 0; index < shards; index++)
+				{
+					locks[index] = std::unique_lock<std::mutex>(m_shards[index].mutex);
+				}
+
+				/* Count free buffers per slab, slabs sorted by address */
+				std::vector<size_t> order(m_slabs.size());
+				for (size_t index = 0; index < order.size(); index++)
+				{
+					order[index] = index;
+				}
+				std::sort(order.begin(), order.end(), [this](size_t a, size_t b) { return m_slabs[a].region.iov_base < m_slabs[b].region.iov_base; });
+
+				std::vector<size_t> free(m_slabs.size(), 0);
+				for (const shard_t &item: m_shards)
+				{
+					for (std::uint8_t *data: item.free)
+					{
+						auto slab = std::upper_bound(order.begin(), order.end(), data, [this](std::uint8_t *value, size_t index) { return value < m_slabs[index].region.iov_base; });
+						free[*(slab - 1)]++;
+					}
+				}
+
+				size_t count = slab_length() / m_buffer_size;
+				size_t length = 0;
+				std::vector<bool> unmap(m_slabs.size(), false);
+				for (size_t index = 0; (index < m_slabs.size()) && (length < bytes); index++)
+				{
+					if (free[index] == count)
+					{
+						unmap[index] = true;
+						length += m_slabs[index].region.iov_len;
+					}
+				}
+				if (!length)
+				{
+					return 0;
+				}
+
+				for (shard_t &item: m_shards)
+				{
+					item.free.erase(std::remove_if(item.free.begin(), item.free.end(), [&](std::uint8_t *data)
+					{
+						auto slab = std::upper_bound(order.begin(), order.end(), data, [this](std::uint8_t *value, size_t index) { return value < m_slabs[index].region.iov_base; });
+						return unmap[*(slab - 1)];
+					}), item.free.end());
+				}
+
+				std::vector<slab_t> kept;
+				for (size_t index = 0; index < m_slabs.size(); index++)
+				{
+					(unmap[index] ? idle : kept).push_back(m_slabs[index]);
+					if (unmap[index] && m_slabs[index].huge)
+					{
+						m_huge_bytes -= m_slabs[index].region.iov_len;
+					}
+				}
+				m_slabs.swap(kept);
+				m_charged -= length;
+			}
+
+			size_t result = 0;
+			for (const slab_t &slab: idle)
+			{
+				munmap(slab.region.iov_base, slab.region.iov_len);
+				result += slab.region.iov_len;
+			}
+			m_budget->release(result);
+			return result;
+		}
+
+	protected:
+		struct shard_t
+		{
+			std::mutex mutex;
+			std::vector<std::uint8_t *> free;
+		};
+
+		struct slab_t
+		{
+			iovec region;
+			bool huge;
+		};
+
+		const size_t m_buffer_size;
+		bool m_hugepages;
+		shard_t m_shards[shards];
+		std::atomic<size_t> m_allocations;
+		std::atomic<size_t> m_in_use;
+		std::atomic<size_t> m_high_water;
+		std::atomic<size_t> m_transient;
+		size_t m_huge_bytes;
+		raidfuse::budget *m_budget;
+		size_t m_charged;
+		std::vector<slab_t> m_slabs;
+		std::mutex m_slab_mutex;
+
+		/**
+		 * @brief Shard of calling thread, assigned round robin on first use
+		 */
+		size_t shard()
+		{
+			static thread_local size_t index = (size_t)-1;
+			if (index == (size_t)-1)
+			{
+				static std::atomic<size_t> next(0);
+				index = next++;
+			}
+			return index % shards;
+		}
+
+		void release(std::uint8_t *data, bool transient)
+		{
+			m_in_use.fetch_sub(1, std::memory_order_relaxed);
+
+			if (transient)
+			{
+				munmap(data, m_buffer_size);
+				m_budget->release(m_buffer_size);
+				return;
+			}
+
+			{
+				shard_t &item = m_shards[shard()];
+				std::lock_guard<std::mutex> lock(item.mutex);
+				item.free.push_back(data);
+			}
+			if (m_budget)
+			{
+				m_budget->wake();
+			}
+		}
+
+		/**
+		 * @brief Take free buffer, from home shard first
+		 * @return nullptr if there is none
+		 */
+		std::uint8_t *take(size_t home)
+		{
+			for (size_t index = 0; index < shards; index++)
+			{
+				shard_t &item = m_shards[(home + index) % shards];
+				std::lock_guard<std::mutex> lock(item.mutex);
+				if (!item.free.empty())
+				{
+					std::uint8_t *data = item.free.back();
+					item.free.pop_back();
+					return data;
+				}
+			}
+			return nullptr;
+		}
+
+		size_t slab_length() const
+		{
+			size_t slab = slab_size;
+			return (std::max(m_buffer_size, slab) + slab - 1) / slab * slab;
+		}
+
+		/**
+		 * @brief Map single buffer, already charged to the budget, unmapped on release
+		 * @return nullptr on failure
+		 */
+		std::uint8_t *transient()
+		{
+			void *data = mmap(nullptr, m_buffer_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (data == MAP_FAILED)
+			{
+				m_in_use.fetch_sub(1, std::memory_order_relaxed);
+				m_budget->release(m_buffer_size);
+				return nullptr;
+			}
+			m_transient.fetch_add(1, std::memory_order_relaxed);
+			return (std::uint8_t *)data;
+		}
+
+		/**
+		 * @brief Map new slab, return first buffer and put the rest into shard
+		 * @param length slab length, already charged to the budget
+		 * @return nullptr on failure
+		 */
+		std::uint8_t *grow(size_t home, size_t length)
+		{
+			void *slab = MAP_FAILED;
+			bool huge = false;
+			if (m_hugepages)
+			{
+				slab = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+				huge = (slab != MAP_FAILED);
+			}
+			if (slab == MAP_FAILED)
+			{
+				/* Over-allocate and trim to get 2 MiB alignment, required for transparent huge pages */
+				void *area = mmap(nullptr, length + slab_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+				if (area == MAP_FAILED)
+				{
+					m_in_use.fetch_sub(1, std::memory_order_relaxed);
+					if (m_budget)
+					{
+						m_budget->release(length);
+					}
+					return nullptr;
+				}
+
+				std::uintptr_t begin = (std::uintptr_t)area;
+				std::uintptr_t aligned = (begin + slab_size - 1) / slab_size * slab_size;
+				if (aligned > begin)
+				{
+					munmap(area, aligned - begin);
+				}
+				if (aligned + length < begin + length + slab_size)
+				{
+					munmap((void *)(aligned + length), begin + slab_size - aligned);
+				}
+				slab = (void *)aligned;
+
+				if (m_hugepages)
+				{
+					madvise(slab, length, MADV_HUGEPAGE);
+				}
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(m_slab_mutex);
+				m_slabs.push_back({ { slab, length }, huge });
+				if (m_budget)
+				{
+					m_charged += length;
+				}
+				if (huge)
+				{
+					m_huge_bytes += length;
+				}
+			}
+
+			std::uint8_t *data = (std::uint8_t *)slab;
+			size_t count = length / m_buffer_size;
+
+			shard_t &item = m_shards[home];
+			std::lock_guard<std::mutex> lock(item.mutex);
+			for (size_t index = 1; index < count; index++)
+			{
+				item.free.push_back(data + index * m_buffer_size);
+			}
+			return data;
+		}
+};
+
+}
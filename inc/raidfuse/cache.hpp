@@ -0,0 +1,623 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <algorithm>
+#include <stdexcept>
+#include <iostream>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <raidfuse/interface.hpp>
+#include <raidfuse/drive.hpp>
+#include <raidfuse/buffer.hpp>
+#include <raidfuse/fingerprint.hpp>
+
+namespace raidfuse {
+
+/**
+ * @brief Read cache in a local file, kept across mounts
+ *
+ * File layout:
+ * - header (4 KiB), including fingerprints of the partition tables of the
+ *   base drive and of its members, see fingerprint
+ * - slot table, one 64 bit entry per slot, block number + 1 or 0 if empty
+ * - block data, aligned to block size
+ *
+ * Missed blocks are read from the base drive as a whole and written to the
+ * cache file before the read returns. Writes go to the base drive and
+ * update cached blocks. Slots are replaced by the clock algorithm with a
+ * small use counter, so blocks read repeatedly survive a sequential pass.
+ *
+ * The header is marked dirty before the first change after a flush and
+ * clean again by flush(), which stamps it with the members as written. A
+ * cache file which was not flushed or does not match the base drive and
+ * its members is emptied on open. So is one whose members were written
+ * meanwhile without the cache, e.g. by a writable mount without --cache,
+ * as their modification times no longer match the stamps.
+ */
+class cache:
+	public interface::drive
+{
+	public:
+		using interface::drive::read;
+
+		static constexpr size_t header_size = 4096;
+		static constexpr size_t max_members = 64;
+		static constexpr std::uint8_t max_uses = 3;
+
+		struct __attribute__((packed)) header_t
+		{
+			std::uint8_t signature[16];
+			std::uint32_t version;
+			std::uint32_t block_size;
+			std::uint64_t base_size;
+			std::uint64_t slots;
+			std::uint32_t clean;
+			std::uint32_t count;
+			std::uint64_t table_fingerprint;
+			std::uint64_t member_fingerprint[max_members];
+			std::uint64_t member_stamp[max_members];
+			std::uint8_t reserved[3016];
+
+			/**
+			 * @note caches of other versions are valid, but never match
+			 */
+			bool valid() const
+			{
+				return !memcmp(signature, "RAIDFUSE CACHE\0\0", sizeof(signature));
+			}
+		};
+		static_assert(sizeof(header_t) == header_size, "Size of cache header mismatch!");
+
+		struct stats_t
+		{
+			size_t hits;
+			size_t misses;
+			size_t used;
+			size_t slots;
+		};
+
+		/**
+		 * @param base drive to cache
+		 * @param members member drives of base in array order
+		 * @param filename cache file, created if missing
+		 * @param size maximum size of cached data in bytes
+		 * @param block_size unit of caching
+		 */
+		cache(interface::drive &base, const std::vector<raidfuse::drive *> &members, std::string filename, size_t size, size_t block_size = 64 * 1024):
+			m_base(base),
+			m_members(members),
+			m_fd(::open(filename.c_str(), O_RDWR | O_CREAT, 0644)),
+			m_block_size(block_size),
+			m_block_lba(block_size / sector_size),
+			m_slots(size / block_size),
+			m_buffers(block_size),
+			m_clean(false),
+			m_failed(false),
+			m_hand(0),
+			m_generation(0),
+			m_hits(0),
+			m_misses(0)
+		{
+			if (m_fd < 0)
+			{
+				throw std::runtime_error("Error opening cache '" + filename + "'");
+			}
+
+			if (!m_block_lba || (m_block_size % m_base.logical_block_size()) || !m_slots || (m_slots > UINT32_MAX))
+			{
+				::close(m_fd);
+				throw std::runtime_error("Invalid size of cache '" + filename + "'");
+			}
+
+			if (m_members.size() > max_members)
+			{
+				::close(m_fd);
+				throw std::runtime_error("Cache '" + filename + "' supports up to 64 members");
+			}
+
+			m_data_offset = header_size + m_slots * sizeof(std::uint64_t);
+			m_data_offset = (m_data_offset + m_block_size - 1) / m_block_size * m_block_size;
+			m_slot.resize(m_slots);
+
+			header_t header;
+			ssize_t result = ::pread(m_fd, &header, sizeof(header), 0);
+			if ((result != 0) && ((result != sizeof(header)) || !header.valid()))
+			{
+				/* Never overwrite a file which is not a cache */
+				::close(m_fd);
+				throw std::runtime_error("Cache '" + filename + "' invalid");
+			}
+
+			header_t expected;
+			memset(&expected, 0, sizeof(expected));
+			memcpy(expected.signature, "RAIDFUSE CACHE\0\0", sizeof(expected.signature));
+			expected.version = 2;
+			expected.block_size = m_block_size;
+			expected.base_size = m_base.size();
+			expected.slots = m_slots;
+			expected.clean = 1;
+			try
+			{
+				identify(expected);
+			}
+			catch (...)
+			{
+				::close(m_fd);
+				throw;
+			}
+
+			if (result && !memcmp(&header, &expected, offsetof(header_t, reserved)))
+			{
+				load(filename);
+			}
+			else
+			{
+				if (result)
+				{
+					std::clog << "cache: '" << filename << "' does not match drive, emptied" << std::endl;
+				}
+				reset(filename, expected);
+			}
+		}
+
+		cache(const cache &) = delete;
+		cache &operator=(const cache &) = delete;
+
+		virtual ~cache()
+		{
+			flush();
+			::close(m_fd);
+		}
+
+		stats_t stats()
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+
+			stats_t result;
+			result.hits = m_hits;
+			result.misses = m_misses;
+			result.used = m_map.size();
+			result.slots = m_slots;
+			return result;
+		}
+
+		virtual size_t size()
+		{
+			return m_base.size();
+		}
+
+		virtual size_t logical_block_size()
+		{
+			return m_base.logical_block_size();
+		}
+
+		virtual size_t physical_block_size()
+		{
+			return m_base.physical_block_size();
+		}
+
+		virtual size_t read(size_t lba, size_t count, std::uint8_t *data)
+		{
+			size_t done = 0;
+			while (count)
+			{
+				size_t block = lba / m_block_lba;
+				size_t index = lba % m_block_lba;
+				size_t length = std::min(count, m_block_lba - index);
+
+				size_t result = read_block(block, index, length, data);
+				done += result;
+				if (result != length * sector_size)
+				{
+					break;
+				}
+
+				data += result;
+				lba += length;
+				count -= length;
+			}
+			return done;
+		}
+
+		/**
+		 * @brief Write to base drive, update cached blocks
+		 */
+		virtual size_t write(size_t lba, size_t count, const std::uint8_t *data)
+		{
+			{
+				/* Members change, the stamps of a clean header would be stale */
+				std::lock_guard<std::mutex> lock(m_mutex);
+				dirty();
+			}
+
+			size_t done = m_base.write(lba, count, data);
+			count = done / sector_size;
+
+			std::unique_lock<std::mutex> lock(m_mutex);
+
+			/* Blocks being filled might have been read before this write */
+			m_generation++;
+
+			while (count)
+			{
+				size_t block = lba / m_block_lba;
+				size_t index = lba % m_block_lba;
+				size_t length = std::min(count, m_block_lba - index);
+
+				auto item = m_map.find(block);
+				if (item != m_map.end())
+				{
+					std::uint32_t slot = item->second;
+					if (!dirty())
+					{
+						drop(slot);
+					}
+					else
+					{
+						m_slot[slot].pins++;
+						lock.unlock();
+						bool success = (write_slot(slot, index, length, data) == length * sector_size);
+						lock.lock();
+						unpin(slot);
+						if (!success)
+						{
+							drop(slot);
+						}
+					}
+				}
+
+				data += length * sector_size;
+				lba += length;
+				count -= length;
+			}
+			return done;
+		}
+
+		/**
+		 * @brief Flush base drive, sync cache file and mark it clean
+		 */
+		virtual bool flush()
+		{
+			bool result = m_base.flush();
+
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_clean || m_failed)
+			{
+				return result;
+			}
+
+			header_t header;
+			if (::fdatasync(m_fd) ||
+				(::pread(m_fd, &header, sizeof(header), 0) != sizeof(header)))
+			{
+				return false;
+			}
+
+			try
+			{
+				identify(header);
+			}
+			catch (const std::runtime_error &)
+			{
+				return false;
+			}
+
+			header.clean = 1;
+			if ((::pwrite(m_fd, &header, sizeof(header), 0) != sizeof(header)) || ::fdatasync(m_fd))
+			{
+				return false;
+			}
+			m_clean = true;
+			return result;
+		}
+
+	protected:
+		struct slot_t
+		{
+			/**
+			 * @brief Cached block, no_block while empty or being filled
+			 */
+			size_t block;
+			std::uint32_t pins;
+			std::uint8_t uses;
+		};
+
+		static constexpr size_t no_block = (size_t)-1;
+
+		interface::drive &m_base;
+		std::vector<raidfuse::drive *> m_members;
+		int m_fd;
+		const size_t m_block_size;
+		const size_t m_block_lba;
+		const size_t m_slots;
+		size_t m_data_offset;
+		buffer_pool m_buffers;
+
+		std::vector<slot_t> m_slot;
+		std::unordered_map<size_t, std::uint32_t> m_map;
+		std::vector<std::uint32_t> m_free;
+		bool m_clean;
+		bool m_failed;
+		size_t m_hand;
+		size_t m_generation;
+		size_t m_hits;
+		size_t m_misses;
+		std::mutex m_mutex;
+
+		void load(const std::string &filename)
+		{
+			std::vector<std::uint64_t> table(m_slots);
+			size_t length = table.size() * sizeof(std::uint64_t);
+			if (::pread(m_fd, &table[0], length, header_size) != (ssize_t)length)
+			{
+				::close(m_fd);
+				throw std::runtime_error("Error reading cache '" + filename + "'");
+			}
+
+			size_t blocks = (m_base.size() + m_block_size - 1) / m_block_size;
+			for (size_t slot = m_slots; slot--; )
+			{
+				m_slot[slot].block = no_block;
+				m_slot[slot].pins = 0;
+				m_slot[slot].uses = 0;
+
+				if (table[slot] && (table[slot] <= blocks) && !m_map.count(table[slot] - 1))
+				{
+					m_slot[slot].block = table[slot] - 1;
+					m_map[table[slot] - 1] = slot;
+				}
+				else
+				{
+					m_free.push_back(slot);
+				}
+			}
+			m_clean = true;
+		}
+
+		/**
+		 * @brief Fill in fingerprints of partition tables and members, stamps of members
+		 */
+		void identify(header_t &header)
+		{
+			header.count = m_members.size();
+			header.table_fingerprint = fingerprint::tables(m_base);
+			for (size_t index = 0; index < m_members.size(); index++)
+			{
+				header.member_fingerprint[index] = fingerprint::member(*m_members[index]);
+				header.member_stamp[index] = fingerprint::stamp(*m_members[index]);
+			}
+		}
+
+		void reset(const std::string &filename, const header_t &header)
+		{
+			/* Truncation zeroes the slot table */
+			if (::ftruncate(m_fd, 0) ||
+				(::pwrite(m_fd, &header, sizeof(header), 0) != sizeof(header)) ||
+				::ftruncate(m_fd, m_data_offset) ||
+				::fdatasync(m_fd))
+			{
+				::close(m_fd);
+				throw std::runtime_error("Error initializing cache '" + filename + "'");
+			}
+
+			for (size_t slot = m_slots; slot--; )
+			{
+				m_slot[slot].block = no_block;
+				m_slot[slot].pins = 0;
+				m_slot[slot].uses = 0;
+				m_free.push_back(slot);
+			}
+			m_clean = true;
+		}
+
+		/**
+		 * @brief Mark cache file dirty before its first change after a flush
+		 * @note called with m_mutex locked
+		 */
+		bool dirty()
+		{
+			if (m_clean)
+			{
+				std::uint32_t clean = 0;
+				if ((::pwrite(m_fd, &clean, sizeof(clean), offsetof(header_t, clean)) != sizeof(clean)) || ::fdatasync(m_fd))
+				{
+					return false;
+				}
+				m_clean = false;
+			}
+			return true;
+		}
+
+		/**
+		 * @brief Read part of block, from cache file or base drive
+		 */
+		size_t read_block(size_t block, size_t index, size_t count, std::uint8_t *data)
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+
+			auto item = m_map.find(block);
+			if (item != m_map.end())
+			{
+				std::uint32_t slot = item->second;
+				m_slot[slot].pins++;
+				std::uint8_t limit = max_uses;
+				m_slot[slot].uses = std::min<std::uint8_t>(m_slot[slot].uses + 1, limit);
+				m_hits++;
+				lock.unlock();
+
+				bool success = (read_slot(slot, index, count, data) == count * sector_size);
+
+				lock.lock();
+				unpin(slot);
+				if (success)
+				{
+					return count * sector_size;
+				}
+				drop(slot);
+			}
+			else
+			{
+				m_misses++;
+			}
+			size_t generation = m_generation;
+			lock.unlock();
+
+			size_t lba = block * m_block_lba;
+			size_t length = std::min(m_block_lba, m_base.size() / sector_size - lba);
+			if (index + count > length)
+			{
+				return 0;
+			}
+
+			/* Without a buffer, the block is read without caching it */
+			buffer_pool::buffer buffer = m_buffers.try_allocate();
+			if (!buffer.data() || (m_base.read(lba, length, buffer.data()) != length * sector_size))
+			{
+				/* Leave error handling to the base drive */
+				return m_base.read(lba + index, count, data);
+			}
+			memcpy(data, buffer.data() + index * sector_size, count * sector_size);
+
+			fill(block, length, buffer.data(), generation);
+			return count * sector_size;
+		}
+
+		/**
+		 * @brief Store block read from base drive, unless it was written meanwhile
+		 */
+		void fill(size_t block, size_t length, std::uint8_t *data, size_t generation)
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+
+			if ((generation != m_generation) || m_map.count(block) || !dirty())
+			{
+				return;
+			}
+
+			std::uint32_t slot;
+			if (!victim(slot))
+			{
+				return;
+			}
+			m_slot[slot].pins++;
+			lock.unlock();
+
+			bool success = (write_slot(slot, 0, length, data) == length * sector_size);
+
+			lock.lock();
+			m_slot[slot].pins--;
+
+			std::uint64_t entry = block + 1;
+			if (success && (generation == m_generation) && !m_map.count(block) &&
+				(::pwrite(m_fd, &entry, sizeof(entry), header_size + slot * sizeof(entry)) == sizeof(entry)))
+			{
+				m_slot[slot].block = block;
+				m_slot[slot].uses = 0;
+				m_map[block] = slot;
+			}
+			else
+			{
+				m_free.push_back(slot);
+			}
+		}
+
+		/**
+		 * @brief Take free slot or evict a cached block
+		 * @note called with m_mutex locked
+		 */
+		bool victim(std::uint32_t &slot)
+		{
+			if (!m_free.empty())
+			{
+				slot = m_free.back();
+				m_free.pop_back();
+				return true;
+			}
+
+			for (size_t step = 0; step < (max_uses + 1) * m_slots; step++)
+			{
+				slot_t &item = m_slot[m_hand];
+				slot = m_hand;
+				m_hand = (m_hand + 1) % m_slots;
+
+				if (item.pins || (item.block == no_block))
+				{
+					continue;
+				}
+				if (item.uses)
+				{
+					item.uses--;
+					continue;
+				}
+
+				/* Slot table must not name the old block while the slot is overwritten */
+				std::uint64_t entry = 0;
+				if (::pwrite(m_fd, &entry, sizeof(entry), header_size + slot * sizeof(entry)) != sizeof(entry))
+				{
+					return false;
+				}
+				m_map.erase(item.block);
+				item.block = no_block;
+				return true;
+			}
+			return false;
+		}
+
+		/**
+		 * @brief Remove block from cache after an error
+		 * @note called with m_mutex locked
+		 */
+		void drop(std::uint32_t slot)
+		{
+			if (m_slot[slot].block == no_block)
+			{
+				return;
+			}
+
+			std::uint64_t entry = 0;
+			if (::pwrite(m_fd, &entry, sizeof(entry), header_size + slot * sizeof(entry)) != sizeof(entry))
+			{
+				/* Stale entry, cache file is emptied on next open */
+				m_failed = true;
+			}
+			m_map.erase(m_slot[slot].block);
+			m_slot[slot].block = no_block;
+			if (!m_slot[slot].pins)
+			{
+				m_free.push_back(slot);
+			}
+		}
+
+		/**
+		 * @brief Release slot after transfer, dropped slots are freed by the last user
+		 * @note called with m_mutex locked
+		 */
+		void unpin(std::uint32_t slot)
+		{
+			if (!--m_slot[slot].pins && (m_slot[slot].block == no_block))
+			{
+				m_free.push_back(slot);
+			}
+		}
+
+		size_t read_slot(size_t slot, size_t index, size_t count, std::uint8_t *data)
+		{
+			return raidfuse::drive::read_fully(m_fd, data, count * sector_size, m_data_offset + slot * m_block_size + index * sector_size);
+		}
+
+		size_t write_slot(size_t slot, size_t index, size_t count, const std::uint8_t *data)
+		{
+			return raidfuse::drive::write_fully(m_fd, data, count * sector_size, m_data_offset + slot * m_block_size + index * sector_size);
+		}
+};
+
+}
@@ -1,8 +1,15 @@
 #pragma once
 
 #include <string>
-#include <fstream>
 #include <stdexcept>
+#include <cerrno>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 
 #include <raidfuse/interface.hpp>
 
@@ -12,17 +19,44 @@ class drive:
 	public interface::drive
 {
 	public:
-		drive(std::string filename):
-			m_stream(filename, std::ios::binary)
+		using interface::drive::read;
+
+		drive(std::string filename, bool writable = false):
+			m_fd(::open(filename.c_str(), writable ? O_RDWR : O_RDONLY)),
+			m_writable(writable)
 		{
-			if (!m_stream.is_open())
+			if (m_fd < 0)
 			{
 				throw std::runtime_error("Error opening file '" + filename + "'");
 			}
 
-			m_stream.seekg(0, std::ios::end);
-			m_size = m_stream.tellg();
-			m_stream.seekg(0);
+			off_t size = ::lseek(m_fd, 0, SEEK_END);
+			if (size < 0)
+			{
+				::close(m_fd);
+				throw std::runtime_error("Error sizing file '" + filename + "'");
+			}
+			m_size = size;
+
+			if (!block_sizes())
+			{
+				::close(m_fd);
+				throw std::runtime_error("Error querying block size of '" + filename + "'");
+			}
+
+			if ((m_logical_block % sector_size) || (m_logical_block & (m_logical_block - 1)) || (m_physical_block & (m_physical_block - 1)) || (m_size % m_logical_block))
+			{
+				::close(m_fd);
+				throw std::runtime_error("Unsupported block size of '" + filename + "'");
+			}
+		}
+
+		drive(const drive &) = delete;
+		drive &operator=(const drive &) = delete;
+
+		virtual ~drive()
+		{
+			::close(m_fd);
 		}
 
 		virtual size_t size()
@@ -30,16 +64,138 @@ class drive:
 			return m_size;
 		}
 
-		virtual size_t read(size_t lba, std::uint8_t *data)
+		virtual size_t logical_block_size()
+		{
+			return m_logical_block;
+		}
+
+		virtual size_t physical_block_size()
+		{
+			return m_physical_block;
+		}
+
+		bool writable() const
+		{
+			return m_writable;
+		}
+
+		/**
+		 * @brief File or device node with its modification time, which every write changes
+		 */
+		bool identity(struct stat &info) const
+		{
+			return !::fstat(m_fd, &info);
+		}
+
+		/**
+		 * @brief Positional read, safe to call from several threads at once
+		 */
+		virtual size_t read(size_t lba, size_t count, std::uint8_t *data)
+		{
+			return read_fully(m_fd, data, count * sector_size, lba * sector_size);
+		}
+
+		virtual size_t write(size_t lba, size_t count, const std::uint8_t *data)
+		{
+			if (!m_writable)
+			{
+				return 0;
+			}
+			return write_fully(m_fd, data, count * sector_size, lba * sector_size);
+		}
+
+		virtual bool flush()
+		{
+			return !m_writable || !::fdatasync(m_fd);
+		}
+
+		/**
+		 * @brief pread() until done, retried on EINTR and short reads
+		 * @return bytes read, less on error or end of file
+		 */
+		static size_t read_fully(int fd, std::uint8_t *data, size_t length, off_t offset)
+		{
+			size_t done = 0;
+			while (done < length)
+			{
+				ssize_t result = ::pread(fd, data + done, length - done, offset + done);
+				if ((result < 0) && (errno == EINTR))
+				{
+					continue;
+				}
+				if (result <= 0)
+				{
+					break;
+				}
+				done += result;
+			}
+			return done;
+		}
+
+		/**
+		 * @brief pwrite() until done, retried on EINTR and short writes
+		 * @return bytes written, less on error
+		 */
+		static size_t write_fully(int fd, const std::uint8_t *data, size_t length, off_t offset)
 		{
-			m_stream.seekg(lba * sector_size);
-			m_stream.read((char *)data, sector_size);
-			return m_stream.gcount();
+			size_t done = 0;
+			while (done < length)
+			{
+				ssize_t result = ::pwrite(fd, data + done, length - done, offset + done);
+				if ((result < 0) && (errno == EINTR))
+				{
+					continue;
+				}
+				if (result <= 0)
+				{
+					break;
+				}
+				done += result;
+			}
+			return done;
 		}
 
 	protected:
-		std::ifstream m_stream;
+		static constexpr size_t max_preferred_block = 4096;
+
+		int m_fd;
+		bool m_writable;
 		size_t m_size;
+		size_t m_logical_block;
+		size_t m_physical_block;
+
+		/**
+		 * @brief Block sizes of device, image files count as 512e with the preferred I/O size of the file system
+		 *
+		 * The preferred I/O size is only a hint, network and copy-on-write file
+		 * systems report 128 KiB to 4 MiB, so it is capped at 4 KiB.
+		 */
+		bool block_sizes()
+		{
+			struct stat info;
+			if (::fstat(m_fd, &info))
+			{
+				return false;
+			}
+
+			if (!S_ISBLK(info.st_mode))
+			{
+				m_logical_block = sector_size;
+				size_t preferred = (info.st_blksize > 0) ? info.st_blksize : 0;
+				m_physical_block = (preferred && !(preferred % sector_size) && !(preferred & (preferred - 1))) ? std::min(preferred, (size_t)max_preferred_block) : sector_size;
+				return true;
+			}
+
+			int logical = 0;
+			unsigned int physical = 0;
+			if (::ioctl(m_fd, BLKSSZGET, &logical) || ::ioctl(m_fd, BLKPBSZGET, &physical) || (logical <= 0))
+			{
+				return false;
+			}
+			m_logical_block = logical;
+			m_physical_block = std::max((size_t)physical, m_logical_block);
+			return true;
+		}
 };
 
 }
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+namespace raidfuse {
+
+/**
+ * @brief Fixed size worker pool
+ *
+ * Tasks are queued per group, e.g. per array, and workers take them from
+ * the groups in turn, so a busy group does not starve the others.
+ */
+class executor
+{
+	public:
+		typedef std::function<void()> task_t;
+
+		executor(size_t threads = std::thread::hardware_concurrency()):
+			m_queued(0),
+			m_next(0),
+			m_stop(false)
+		{
+			for (size_t index = 0; index < std::max(threads, (size_t)1); index++)
+			{
+				m_threads.push_back(std::thread(&executor::worker, this));
+			}
+		}
+
+		executor(const executor &) = delete;
+		executor &operator=(const executor &) = delete;
+
+		/**
+		 * @brief Finish queued tasks and join workers
+		 */
+		~executor()
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_stop = true;
+			}
+			m_condition.notify_all();
+
+			for (std::thread &thread: m_threads)
+			{
+				thread.join();
+			}
+		}
+
+		size_t threads() const { return m_threads.size(); }
+
+		void submit(task_t task, size_t group = 0)
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				if (group >= m_tasks.size())
+				{
+					m_tasks.resize(group + 1);
+				}
+				m_tasks[group].push(std::move(task));
+				m_queued++;
+			}
+			m_condition.notify_one();
+		}
+
+	protected:
+		/**
+		 * @brief Ring of tasks, grows but never shrinks, so a warm queue does not allocate
+		 */
+		class queue_t
+		{
+			public:
+				queue_t():
+					m_head(0),
+					m_size(0)
+				{
+
+				}
+
+				bool empty() const { return !m_size; }
+
+				void push(task_t &&task)
+				{
+					if (m_size == m_ring.size())
+					{
+						std::vector<task_t> ring(std::max(2 * m_ring.size(), (size_t)16));
+						for (size_t index = 0; index < m_size; index++)
+						{
+							ring[index] = std::move(m_ring[(m_head + index) % m_ring.size()]);
+						}
+						m_ring.swap(ring);
+						m_head = 0;
+					}
+					m_ring[(m_head + m_size) % m_ring.size()] = std::move(task);
+					m_size++;
+				}
+
+				task_t pop()
+				{
+					task_t task = std::move(m_ring[m_head]);
+					m_ring[m_head] = nullptr;
+					m_head = (m_head + 1) % m_ring.size();
+					m_size--;
+					return task;
+				}
+
+			protected:
+				std::vector<task_t> m_ring;
+				size_t m_head;
+				size_t m_size;
+		};
+
+		std::vector<std::thread> m_threads;
+		std::vector<queue_t> m_tasks;
+		size_t m_queued;
+		size_t m_next;
+		bool m_stop;
+		std::mutex m_mutex;
+		std::condition_variable m_condition;
+
+		void worker()
+		{
+			for (;;)
+			{
+				task_t task;
+				{
+					std::unique_lock<std::mutex> lock(m_mutex);
+					m_condition.wait(lock, [this] { return m_stop || m_queued; });
+					if (!m_queued)
+					{
+						return;
+					}
+
+					while (m_tasks[m_next % m_tasks.size()].empty())
+					{
+						m_next++;
+					}
+					task = m_tasks[m_next++ % m_tasks.size()].pop();
+					m_queued--;
+				}
+				task();
+			}
+		}
+};
+
+}
@@ -0,0 +1,401 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <chrono>
+#include <stdexcept>
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <raidfuse/interface.hpp>
+#include <raidfuse/hash.hpp>
+#include <raidfuse/buffer.hpp>
+
+namespace raidfuse {
+
+/**
+ * @brief Range of sectors
+ */
+struct extent_t
+{
+	size_t lba;
+	size_t count;
+};
+
+/**
+ * @brief Stream a drive into a file descriptor
+ *
+ * Reader threads fill a bounded ring of aligned buffers while the calling
+ * thread writes them out in order, so reads on the members overlap with
+ * writes to the output.
+ */
+class exporter
+{
+	public:
+		struct status_t
+		{
+			size_t done;
+			size_t total;
+			size_t skipped;
+			double rate;
+		};
+
+		exporter(interface::drive &source, int fd, size_t block_size = 4 * 1024 * 1024, size_t depth = 8, size_t threads = 4):
+			m_source(source),
+			m_fd(fd),
+			m_block_lba(std::max(block_size / interface::drive::sector_size, (size_t)1)),
+			m_depth(std::max(depth, (size_t)1)),
+			m_threads(std::max(threads, (size_t)1)),
+			m_buffers(m_block_lba * interface::drive::sector_size),
+			m_sparse(false),
+			m_hash(nullptr),
+			m_offset(0),
+			m_next(0),
+			m_failed(false)
+		{
+			m_extents.push_back({ 0, source.size() / interface::drive::sector_size });
+		}
+
+		exporter(const exporter &) = delete;
+		exporter &operator=(const exporter &) = delete;
+
+		/**
+		 * @brief Skip writing all-zero blocks, only effective on regular files
+		 */
+		void sparse(bool enable) { m_sparse = enable; }
+
+		/**
+		 * @brief Hash the output stream while writing, starting at offset
+		 */
+		void hash(interface::hash *hash) { m_hash = hash; }
+
+		/**
+		 * @brief Resume at byte offset, rounded down to sector boundary
+		 *
+		 * A regular output file is cut at the offset, so ranges skipped
+		 * behind it read back as zero.
+		 */
+		void offset(size_t offset) { m_offset = offset / interface::drive::sector_size; }
+
+		/**
+		 * @brief Restrict export to sorted, non overlapping extents
+		 *
+		 * Everything outside the extents is treated as zero.
+		 */
+		void extents(const std::vector<extent_t> &extents) { m_extents = extents; }
+
+		/**
+		 * @brief Called about once a second and after the last block
+		 */
+		void progress(std::function<void(const status_t &)> callback) { m_progress = callback; }
+
+		/**
+		 * @brief Pool of the ring buffers, e.g. for huge pages or stats
+		 */
+		buffer_pool &buffers() { return m_buffers; }
+
+		/**
+		 * @brief Run export
+		 * @return final status
+		 */
+		status_t run()
+		{
+			plan();
+
+			struct stat info;
+			if (fstat(m_fd, &info))
+			{
+				throw std::runtime_error("Error accessing output");
+			}
+			bool seekable = S_ISREG(info.st_mode) || S_ISBLK(info.st_mode);
+			bool holes = S_ISREG(info.st_mode);
+			bool sparse = m_sparse && holes;
+
+			size_t total = m_source.size();
+			size_t start = std::min(m_offset * interface::drive::sector_size, total);
+
+			/* Old content behind the offset would survive in skipped ranges */
+			if (holes && ftruncate(m_fd, start))
+			{
+				throw std::runtime_error("Error resizing output");
+			}
+
+			m_slots.resize(m_depth);
+			for (size_t index = 0; index < m_depth; index++)
+			{
+				m_slots[index].buffer = m_buffers.allocate();
+				m_slots[index].data = m_slots[index].buffer.data();
+				m_slots[index].index = index;
+				m_slots[index].filled = false;
+			}
+			std::vector<std::uint8_t> zero(m_hash || !holes ? m_block_lba * interface::drive::sector_size : 0);
+
+			m_next = 0;
+			m_failed = false;
+			std::vector<std::thread> readers;
+			for (size_t index = 0; index < std::min(m_threads, m_blocks.size()); index++)
+			{
+				readers.push_back(std::thread(&exporter::reader, this));
+			}
+
+			status_t status = { 0, total - start, 0, 0.0 };
+			auto begin = std::chrono::steady_clock::now();
+			auto report = begin;
+			size_t position = start;
+
+			try
+			{
+				for (size_t index = 0; index < m_blocks.size(); index++)
+				{
+					slot_t &slot = m_slots[index % m_depth];
+					{
+						std::unique_lock<std::mutex> lock(m_mutex);
+						m_condition.wait(lock, [&] { return m_failed || (slot.filled && (slot.index == index)); });
+						if (m_failed)
+						{
+							break;
+						}
+					}
+
+					const extent_t &block = m_blocks[index];
+					size_t offset = block.lba * interface::drive::sector_size;
+					size_t length = block.count * interface::drive::sector_size;
+
+					gap(position, offset, seekable, holes, zero);
+
+					if (m_hash)
+					{
+						m_hash->update(slot.data, length);
+					}
+
+					if (sparse && is_zero(slot.data, length))
+					{
+						status.skipped += length;
+					}
+					else
+					{
+						output(slot.data, length, offset, seekable);
+					}
+					position = offset + length;
+
+					{
+						std::lock_guard<std::mutex> lock(m_mutex);
+						slot.filled = false;
+						slot.index = index + m_depth;
+					}
+					m_condition.notify_all();
+
+					status.done = position - start;
+					auto now = std::chrono::steady_clock::now();
+					if (m_progress && (now - report >= std::chrono::seconds(1)))
+					{
+						status.rate = status.done / std::chrono::duration<double>(now - begin).count();
+						m_progress(status);
+						report = now;
+					}
+				}
+
+				if (!m_failed)
+				{
+					gap(position, total, seekable, holes, zero);
+					position = total;
+				}
+			}
+			catch (...)
+			{
+				fail(std::current_exception());
+			}
+
+			for (std::thread &thread: readers)
+			{
+				thread.join();
+			}
+			m_slots.clear();
+
+			if (m_error)
+			{
+				std::rethrow_exception(m_error);
+			}
+
+			if (S_ISREG(info.st_mode) && ftruncate(m_fd, total))
+			{
+				throw std::runtime_error("Error resizing output");
+			}
+
+			status.done = position - start;
+			status.rate = status.done / std::max(std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count(), 1e-9);
+			if (m_progress)
+			{
+				m_progress(status);
+			}
+			return status;
+		}
+
+	protected:
+		struct slot_t
+		{
+			buffer_pool::buffer buffer;
+			std::uint8_t *data;
+			size_t index;
+			bool filled;
+		};
+
+		interface::drive &m_source;
+		int m_fd;
+		const size_t m_block_lba;
+		const size_t m_depth;
+		const size_t m_threads;
+		buffer_pool m_buffers;
+
+		bool m_sparse;
+		interface::hash *m_hash;
+		size_t m_offset;
+		std::vector<extent_t> m_extents;
+		std::function<void(const status_t &)> m_progress;
+
+		std::vector<extent_t> m_blocks;
+		std::vector<slot_t> m_slots;
+		size_t m_next;
+		bool m_failed;
+		std::exception_ptr m_error;
+		std::mutex m_mutex;
+		std::condition_variable m_condition;
+
+		/**
+		 * @brief Split extents behind offset into blocks of at most m_block_lba sectors
+		 */
+		void plan()
+		{
+			size_t end = m_source.size() / interface::drive::sector_size;
+
+			m_blocks.clear();
+			for (const extent_t &extent: m_extents)
+			{
+				size_t lba = std::max(extent.lba, m_offset);
+				size_t last = std::min(extent.lba + extent.count, end);
+				while (lba < last)
+				{
+					size_t count = std::min(m_block_lba, last - lba);
+					m_blocks.push_back({ lba, count });
+					lba += count;
+				}
+			}
+		}
+
+		void reader()
+		{
+			try
+			{
+				for (;;)
+				{
+					size_t index;
+					{
+						std::unique_lock<std::mutex> lock(m_mutex);
+						if (m_failed || (m_next >= m_blocks.size()))
+						{
+							return;
+						}
+						index = m_next++;
+						slot_t &slot = m_slots[index % m_depth];
+						m_condition.wait(lock, [&] { return m_failed || (!slot.filled && (slot.index == index)); });
+						if (m_failed)
+						{
+							return;
+						}
+					}
+
+					slot_t &slot = m_slots[index % m_depth];
+					const extent_t &block = m_blocks[index];
+					if (m_source.read(block.lba, block.count, slot.data) != block.count * interface::drive::sector_size)
+					{
+						throw std::runtime_error("Read error at LBA " + std::to_string(block.lba));
+					}
+
+					{
+						std::lock_guard<std::mutex> lock(m_mutex);
+						slot.filled = true;
+					}
+					m_condition.notify_all();
+				}
+			}
+			catch (...)
+			{
+				fail(std::current_exception());
+			}
+		}
+
+		void fail(std::exception_ptr error)
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				if (!m_error)
+				{
+					m_error = error;
+				}
+				m_failed = true;
+			}
+			m_condition.notify_all();
+		}
+
+		/**
+		 * @brief Account for zero range between two blocks, written unless the output has holes
+		 */
+		void gap(size_t from, size_t to, bool seekable, bool holes, const std::vector<std::uint8_t> &zero)
+		{
+			if (!m_hash && holes)
+			{
+				return;
+			}
+
+			while (from < to)
+			{
+				size_t length = std::min(to - from, zero.size());
+				if (m_hash)
+				{
+					m_hash->update(&zero[0], length);
+				}
+				if (!holes)
+				{
+					output(&zero[0], length, from, seekable);
+				}
+				from += length;
+			}
+		}
+
+		void output(const std::uint8_t *data, size_t length, size_t offset, bool seekable)
+		{
+			while (length)
+			{
+				ssize_t result = seekable ? ::pwrite(m_fd, data, length, offset) : ::write(m_fd, data, length);
+				if (result < 0)
+				{
+					if (errno == EINTR)
+					{
+						continue;
+					}
+					throw std::runtime_error(std::string("Write error: ") + strerror(errno));
+				}
+				data += result;
+				offset += result;
+				length -= result;
+			}
+		}
+
+		static bool is_zero(const std::uint8_t *data, size_t length)
+		{
+			return !length || (!data[0] && !memcmp(data, data + 1, length - 1));
+		}
+};
+
+}
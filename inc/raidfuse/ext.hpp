@@ -0,0 +1,22 @@
+#pragma once
+
+#include <vector>
+
+#include <raidfuse/interface.hpp>
+#include <raidfuse/exporter.hpp>
+
+namespace raidfuse { namespace ext {
+
+/**
+ * @brief Collect allocated blocks of an ext2/3/4 filesystem
+ *
+ * The block bitmaps are read through libext2fs, which also takes care of
+ * uninitialized block groups and bigalloc clusters.
+ *
+ * @param drive drive holding the filesystem, usually a partition
+ * @param gap unallocated ranges up to this many bytes are merged into the surrounding extents
+ * @return sorted sector extents
+ */
+std::vector<extent_t> allocated(interface::drive &drive, size_t gap = 256 * 1024);
+
+} }
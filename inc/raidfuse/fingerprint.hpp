@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+#include <sys/stat.h>
+
+#include <raidfuse/interface.hpp>
+#include <raidfuse/drive.hpp>
+#include <raidfuse/hash.hpp>
+#include <raidfuse/gpt.hpp>
+
+namespace raidfuse {
+
+/**
+ * @brief Fingerprints of members and arrays, to check state kept across mounts
+ *
+ * A member fingerprint is the hash of the first 16 KiB of the member, it
+ * identifies the members and their order. The table fingerprint of an
+ * assembled array covers the first two logical blocks with protective MBR
+ * and GPT header, plus the partition entry array the header points to.
+ * Without GPT it is the hash of the first 16 KiB as well. A stamp
+ * identifies the file or device node of a member and its modification
+ * time, which any write to the member changes.
+ */
+class fingerprint
+{
+	public:
+		static constexpr size_t member_size = 16 * 1024;
+		static constexpr size_t max_table_size = 1024 * 1024;
+
+		static std::uint64_t member(interface::drive &drive)
+		{
+			hash::xxh64 digest;
+			size_t limit = member_size;
+			update(digest, drive, 0, std::min(limit, drive.size()));
+			return value(digest);
+		}
+
+		static std::uint64_t tables(interface::drive &drive)
+		{
+			size_t block = drive.logical_block_size();
+			size_t block_lba = block / interface::drive::sector_size;
+			if (drive.size() < 2 * block)
+			{
+				return member(drive);
+			}
+
+			std::vector<std::uint8_t> blocks(2 * block);
+			if (drive.read(0, 2 * block_lba, &blocks[0]) != blocks.size())
+			{
+				throw std::runtime_error("Error reading fingerprint");
+			}
+
+			gpt::header_t header;
+			memcpy(&header, &blocks[block], sizeof(header));
+			size_t entries = (size_t)header.partition_count * header.partition_size;
+			size_t offset = header.partition_lba * block;
+			if (!header.valid() || !entries || (offset < 2 * block) || (offset >= drive.size()) || (entries > max_table_size) || (entries > drive.size() - offset))
+			{
+				return member(drive);
+			}
+
+			hash::xxh64 digest;
+			digest.update(&blocks[0], blocks.size());
+			update(digest, drive, offset, entries);
+			return value(digest);
+		}
+
+		static std::uint64_t stamp(raidfuse::drive &drive)
+		{
+			struct stat info;
+			if (!drive.identity(info))
+			{
+				throw std::runtime_error("Error reading identity of member");
+			}
+
+			std::uint64_t fields[] = { (std::uint64_t)info.st_dev, (std::uint64_t)info.st_ino, (std::uint64_t)info.st_rdev, (std::uint64_t)info.st_mtim.tv_sec, (std::uint64_t)info.st_mtim.tv_nsec };
+			hash::xxh64 digest;
+			digest.update((const std::uint8_t *)fields, sizeof(fields));
+			return value(digest);
+		}
+
+	protected:
+		static std::uint64_t value(hash::xxh64 &digest)
+		{
+			return std::strtoull(digest.digest().c_str(), nullptr, 16);
+		}
+
+		/**
+		 * @brief Hash byte range of drive, rounded up to full sectors
+		 */
+		static void update(hash::xxh64 &digest, interface::drive &drive, size_t offset, size_t length)
+		{
+			size_t lba = offset / interface::drive::sector_size;
+			size_t count = std::min((length + interface::drive::sector_size - 1) / interface::drive::sector_size, drive.size() / interface::drive::sector_size - lba);
+			std::vector<std::uint8_t> buffer(std::max(count * interface::drive::sector_size, (size_t)1));
+			if (drive.read(lba, count, &buffer[0]) != count * interface::drive::sector_size)
+			{
+				throw std::runtime_error("Error reading fingerprint");
+			}
+			digest.update(&buffer[0], count * interface::drive::sector_size);
+		}
+};
+
+}
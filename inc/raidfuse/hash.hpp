@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+namespace raidfuse { namespace interface {
+
+class hash
+{
+	public:
+		virtual ~hash() {}
+
+		virtual void update(const std::uint8_t *data, size_t size) = 0;
+
+		/**
+		 * @brief Finish calculation
+		 * @return digest as lower case hex string
+		 */
+		virtual std::string digest() = 0;
+};
+
+} }
+
+namespace raidfuse { namespace hash {
+
+/**
+ * @see FIPS 180-4
+ */
+class sha256:
+	public interface::hash
+{
+	public:
+		sha256();
+
+		virtual void update(const std::uint8_t *data, size_t size);
+		virtual std::string digest();
+
+	protected:
+		std::uint32_t m_state[8];
+		std::uint8_t m_block[64];
+		std::uint64_t m_length;
+		size_t m_fill;
+
+		void transform(const std::uint8_t *block);
+};
+
+/**
+ * @see https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+ */
+class xxh64:
+	public interface::hash
+{
+	public:
+		xxh64(std::uint64_t seed = 0);
+
+		virtual void update(const std::uint8_t *data, size_t size);
+		virtual std::string digest();
+
+	protected:
+		std::uint64_t m_seed;
+		std::uint64_t m_state[4];
+		std::uint8_t m_block[32];
+		std::uint64_t m_length;
+		size_t m_fill;
+
+		void transform(const std::uint8_t *block);
+};
+
+} }
@@ -5,13 +5,64 @@
 
 namespace raidfuse { namespace interface {
 
+/**
+ * @brief Block device
+ *
+ * Addresses are always counted in sectors of sector_size bytes, whatever
+ * the device uses internally. The block sizes tell which alignment the
+ * device needs and which one it handles best.
+ */
 class drive
 {
 	public:
 		static constexpr size_t sector_size = 512;
 
 		virtual size_t size() = 0;
-		virtual size_t read(size_t lba, std::uint8_t *data) = 0;
+
+		/**
+		 * @brief Smallest unit the device addresses in bytes, e.g. 4096 on 4Kn drives
+		 */
+		virtual size_t logical_block_size()
+		{
+			return sector_size;
+		}
+
+		/**
+		 * @brief Unit the device reads and writes without extra work in bytes, e.g. 4096 on 512e drives
+		 */
+		virtual size_t physical_block_size()
+		{
+			return sector_size;
+		}
+
+		/**
+		 * @brief Read consecutive sectors
+		 * @param lba first sector
+		 * @param count number of sectors
+		 * @param data buffer of at least count * sector_size bytes
+		 * @return number of bytes read
+		 */
+		virtual size_t read(size_t lba, size_t count, std::uint8_t *data) = 0;
+
+		size_t read(size_t lba, std::uint8_t *data)
+		{
+			return read(lba, 1, data);
+		}
+
+		/**
+		 * @brief Write consecutive sectors
+		 * @param lba first sector
+		 * @param count number of sectors
+		 * @param data buffer of count * sector_size bytes
+		 * @return number of bytes accepted, 0 if drive is read-only
+		 */
+		virtual size_t write(size_t lba, size_t count, const std::uint8_t *data) = 0;
+
+		/**
+		 * @brief Make all accepted writes durable
+		 * @return false on error
+		 */
+		virtual bool flush() = 0;
 };
 
 } }
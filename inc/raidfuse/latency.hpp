@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+
+namespace raidfuse {
+
+/**
+ * @brief Lock free latency histogram
+ *
+ * Buckets are powers of two nanoseconds, each split into four linear
+ * sub-buckets, which keeps percentiles within 25 %.
+ */
+class latency
+{
+	public:
+		static constexpr size_t sub_bits = 2;
+		static constexpr size_t buckets = 64 << sub_bits;
+
+		latency():
+			m_count(0),
+			m_total(0)
+		{
+			for (std::atomic<std::uint64_t> &bucket: m_bucket)
+			{
+				bucket = 0;
+			}
+		}
+
+		void record(std::chrono::nanoseconds duration)
+		{
+			std::uint64_t value = std::max(duration.count(), (std::chrono::nanoseconds::rep)1);
+			m_bucket[index(value)].fetch_add(1, std::memory_order_relaxed);
+			m_count.fetch_add(1, std::memory_order_relaxed);
+			m_total.fetch_add(value, std::memory_order_relaxed);
+		}
+
+		std::uint64_t count() const
+		{
+			return m_count.load(std::memory_order_relaxed);
+		}
+
+		std::chrono::nanoseconds mean() const
+		{
+			std::uint64_t count = this->count();
+			return std::chrono::nanoseconds(count ? m_total.load(std::memory_order_relaxed) / count : 0);
+		}
+
+		/**
+		 * @brief Upper bound of the bucket holding the given percentile
+		 * @param percentile 0 .. 100
+		 */
+		std::chrono::nanoseconds percentile(double percentile) const
+		{
+			std::uint64_t count = this->count();
+			if (!count)
+			{
+				return std::chrono::nanoseconds(0);
+			}
+
+			std::uint64_t target = std::max((std::uint64_t)(count * percentile / 100.0), (std::uint64_t)1);
+			std::uint64_t sum = 0;
+			for (size_t bucket = 0; bucket < buckets; bucket++)
+			{
+				sum += m_bucket[bucket].load(std::memory_order_relaxed);
+				if (sum >= target)
+				{
+					return std::chrono::nanoseconds(upper(bucket));
+				}
+			}
+			return std::chrono::nanoseconds(upper(buckets - 1));
+		}
+
+	protected:
+		std::atomic<std::uint64_t> m_bucket[buckets];
+		std::atomic<std::uint64_t> m_count;
+		std::atomic<std::uint64_t> m_total;
+
+		static size_t index(std::uint64_t value)
+		{
+			if (value < (1u << sub_bits))
+			{
+				return value;
+			}
+
+			size_t msb = 63 - __builtin_clzll(value);
+			size_t sub = (value >> (msb - sub_bits)) & ((1 << sub_bits) - 1);
+			return ((msb - sub_bits + 1) << sub_bits) + sub;
+		}
+
+		static std::uint64_t upper(size_t bucket)
+		{
+			if (bucket < (1u << sub_bits))
+			{
+				return bucket;
+			}
+
+			size_t msb = (bucket >> sub_bits) + sub_bits - 1;
+			size_t sub = bucket & ((1 << sub_bits) - 1);
+			return ((std::uint64_t)((1 << sub_bits) + sub + 1) << (msb - sub_bits)) - 1;
+		}
+};
+
+}
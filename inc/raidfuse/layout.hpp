@@ -0,0 +1,140 @@
+#pragma once
+
+#include <cstddef>
+
+namespace raidfuse { namespace layout {
+
+/**
+ * @brief Array geometry, passed to the generic mapping
+ */
+struct geometry_t
+{
+	size_t count;
+	size_t stripe_lba;
+	size_t logical_sequence;
+	const size_t *offset;
+};
+
+/**
+ * @brief Map logical chunk to member and stripe row
+ */
+typedef void (*map_t)(const geometry_t &geometry, size_t chunk, size_t &drive, size_t &row);
+
+/**
+ * @brief Map logical sector to member sector
+ * @return sectors left in the chunk, starting at lba
+ */
+typedef size_t (*split_t)(const geometry_t &geometry, size_t lba, size_t &drive, size_t &member_lba);
+
+struct kernel_t
+{
+	map_t map;
+	split_t split;
+	bool specialized;
+};
+
+/**
+ * @brief Any geometry, based on the stripe offset table
+ */
+struct generic
+{
+	static void map(const geometry_t &geometry, size_t chunk, size_t &drive, size_t &row)
+	{
+		size_t physical_stripe = chunk / geometry.logical_sequence;
+		size_t physical_drive = chunk % geometry.logical_sequence;
+
+		size_t logical = chunk + physical_stripe * geometry.count + geometry.offset[physical_drive];
+		row = logical / geometry.count;
+		drive = logical % geometry.count;
+	}
+
+	static size_t split(const geometry_t &geometry, size_t lba, size_t &drive, size_t &member_lba)
+	{
+		size_t row;
+		size_t index = lba % geometry.stripe_lba;
+		map(geometry, lba / geometry.stripe_lba, drive, row);
+		member_lba = row * geometry.stripe_lba + index;
+		return geometry.stripe_lba - index;
+	}
+};
+
+/**
+ * @brief Geometry known at compile time
+ *
+ * All divisions are by constants, so the compiler turns them into shifts
+ * and multiplications. The offset table is not needed: data chunk k of a
+ * row lives on member k, or k + 1 at and behind the parity member.
+ */
+template <size_t Count, size_t StripeLba>
+struct fixed
+{
+	static_assert(Count >= 3, "RAID 5 needs at least three members");
+	static_assert(StripeLba && !(StripeLba & (StripeLba - 1)), "Chunk size must be a power of two");
+
+	static void map(const geometry_t &, size_t chunk, size_t &drive, size_t &row)
+	{
+		row = chunk / (Count - 1);
+		drive = chunk % (Count - 1);
+		if (drive >= Count - 1 - (row % Count))
+		{
+			drive++;
+		}
+	}
+
+	static size_t split(const geometry_t &geometry, size_t lba, size_t &drive, size_t &member_lba)
+	{
+		size_t row;
+		size_t index = lba % StripeLba;
+		map(geometry, lba / StripeLba, drive, row);
+		member_lba = row * StripeLba + index;
+		return StripeLba - index;
+	}
+};
+
+namespace detail {
+
+template <size_t Count, size_t StripeLba>
+inline bool select_chunk(size_t stripe_lba, kernel_t &kernel)
+{
+	if (stripe_lba != StripeLba)
+	{
+		return false;
+	}
+	kernel.map = &fixed<Count, StripeLba>::map;
+	kernel.split = &fixed<Count, StripeLba>::split;
+	kernel.specialized = true;
+	return true;
+}
+
+/* 64 KiB to 1 MiB chunks */
+template <size_t Count>
+inline bool select_count(size_t count, size_t stripe_lba, kernel_t &kernel)
+{
+	return (count == Count) && (
+		select_chunk<Count, 128>(stripe_lba, kernel) ||
+		select_chunk<Count, 256>(stripe_lba, kernel) ||
+		select_chunk<Count, 512>(stripe_lba, kernel) ||
+		select_chunk<Count, 1024>(stripe_lba, kernel) ||
+		select_chunk<Count, 2048>(stripe_lba, kernel));
+}
+
+}
+
+/**
+ * @brief Select mapping for geometry, specialized for 3 to 8 members and 64 KiB to 1 MiB chunks
+ */
+inline kernel_t select(size_t count, size_t stripe_lba)
+{
+	kernel_t kernel = { &generic::map, &generic::split, false };
+
+	detail::select_count<3>(count, stripe_lba, kernel) ||
+	detail::select_count<4>(count, stripe_lba, kernel) ||
+	detail::select_count<5>(count, stripe_lba, kernel) ||
+	detail::select_count<6>(count, stripe_lba, kernel) ||
+	detail::select_count<7>(count, stripe_lba, kernel) ||
+	detail::select_count<8>(count, stripe_lba, kernel);
+
+	return kernel;
+}
+
+} }
@@ -0,0 +1,365 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <raidfuse/interface.hpp>
+#include <raidfuse/drive.hpp>
+
+namespace raidfuse {
+
+/**
+ * @brief Copy-on-write layer, writes are redirected into a sparse local file
+ *
+ * File layout:
+ * - header (4 KiB)
+ * - slot table, one 64 bit chunk number per slot, sized for the whole base drive
+ * - chunk data, aligned to chunk size
+ *
+ * The slot table is only written as far as slots are used, so the file stays
+ * sparse. Chunks are looked up in a two level radix table.
+ */
+class overlay:
+	public interface::drive
+{
+	public:
+		using interface::drive::read;
+
+		static constexpr size_t header_size = 4096;
+		static constexpr size_t leaf_bits = 12;
+		static constexpr size_t leaf_size = 1 << leaf_bits;
+
+		struct __attribute__((packed)) header_t
+		{
+			std::uint8_t signature[16];
+			std::uint32_t version;
+			std::uint32_t chunk_size;
+			std::uint64_t base_size;
+			std::uint64_t used;
+			std::uint8_t reserved[4056];
+
+			bool valid() const
+			{
+				return !memcmp(signature, "RAIDFUSE OVERLAY", sizeof(signature)) && (version == 1);
+			}
+		};
+		static_assert(sizeof(header_t) == header_size, "Size of overlay header mismatch!");
+
+		overlay(interface::drive &base, std::string filename, size_t chunk_size = 64 * 1024):
+			m_base(base),
+			m_fd(::open(filename.c_str(), O_RDWR | O_CREAT, 0644)),
+			m_used(0)
+		{
+			if (m_fd < 0)
+			{
+				throw std::runtime_error("Error opening overlay '" + filename + "'");
+			}
+
+			header_t header;
+			ssize_t result = ::pread(m_fd, &header, sizeof(header), 0);
+			if (result == 0)
+			{
+				memset(&header, 0, sizeof(header));
+				memcpy(header.signature, "RAIDFUSE OVERLAY", sizeof(header.signature));
+				header.version = 1;
+				header.chunk_size = chunk_size;
+				header.base_size = base.size();
+				header.used = 0;
+				if (::pwrite(m_fd, &header, sizeof(header), 0) != sizeof(header))
+				{
+					::close(m_fd);
+					throw std::runtime_error("Error initializing overlay '" + filename + "'");
+				}
+			}
+			else
+			if ((result != sizeof(header)) || !header.valid())
+			{
+				::close(m_fd);
+				throw std::runtime_error("Overlay '" + filename + "' invalid");
+			}
+
+			if (header.base_size != base.size())
+			{
+				::close(m_fd);
+				throw std::runtime_error("Overlay '" + filename + "' belongs to drive of different size");
+			}
+
+			if (!header.chunk_size || (header.chunk_size % base.logical_block_size()))
+			{
+				::close(m_fd);
+				throw std::runtime_error("Overlay '" + filename + "' has invalid chunk size");
+			}
+
+			m_chunk_size = header.chunk_size;
+			m_chunk_lba = m_chunk_size / sector_size;
+			m_chunks = (base.size() + m_chunk_size - 1) / m_chunk_size;
+			m_data_offset = header_size + m_chunks * sizeof(std::uint64_t);
+			m_data_offset = (m_data_offset + m_chunk_size - 1) / m_chunk_size * m_chunk_size;
+			m_index.resize((m_chunks + leaf_size - 1) >> leaf_bits);
+
+			std::vector<std::uint64_t> table(header.used);
+			size_t length = table.size() * sizeof(std::uint64_t);
+			if (length && (::pread(m_fd, &table[0], length, header_size) != (ssize_t)length))
+			{
+				::close(m_fd);
+				throw std::runtime_error("Error reading overlay '" + filename + "'");
+			}
+			for (size_t slot = 0; slot < table.size(); slot++)
+			{
+				if (table[slot] >= m_chunks)
+				{
+					::close(m_fd);
+					throw std::runtime_error("Overlay '" + filename + "' corrupt");
+				}
+				insert(table[slot], slot);
+			}
+			m_used = table.size();
+			m_committed = m_used;
+		}
+
+		overlay(const overlay &) = delete;
+		overlay &operator=(const overlay &) = delete;
+
+		virtual ~overlay()
+		{
+			flush();
+			::close(m_fd);
+		}
+
+		/**
+		 * @brief Number of redirected chunks
+		 */
+		size_t used() const { return m_used; }
+
+		virtual size_t size()
+		{
+			return m_base.size();
+		}
+
+		virtual size_t logical_block_size()
+		{
+			return m_base.logical_block_size();
+		}
+
+		virtual size_t physical_block_size()
+		{
+			return m_base.physical_block_size();
+		}
+
+		virtual size_t read(size_t lba, size_t count, std::uint8_t *data)
+		{
+			/* Nothing redirected -> no lookup, no lock */
+			if (!m_used.load(std::memory_order_acquire))
+			{
+				return m_base.read(lba, count, data);
+			}
+
+			size_t done = 0;
+			while (count)
+			{
+				size_t chunk = lba / m_chunk_lba;
+				size_t index = lba % m_chunk_lba;
+				size_t length = std::min(count, m_chunk_lba - index);
+				size_t result;
+
+				/* Only the lookup is locked, slots are never reused, so data I/O runs in parallel */
+				std::uint32_t slot;
+				{
+					std::lock_guard<std::mutex> lock(m_mutex);
+					slot = lookup(chunk);
+					if (!slot)
+					{
+						/* Extend over following chunks which are not redirected */
+						while ((length < count) && !lookup(chunk + (index + length) / m_chunk_lba))
+						{
+							length = std::min(count, length + m_chunk_lba);
+						}
+					}
+				}
+
+				if (slot)
+				{
+					result = read_slot(slot - 1, index, length, data);
+				}
+				else
+				{
+					result = m_base.read(lba, length, data);
+				}
+
+				done += result;
+				if (result != length * sector_size)
+				{
+					break;
+				}
+
+				data += result;
+				lba += length;
+				count -= length;
+			}
+			return done;
+		}
+
+		virtual size_t write(size_t lba, size_t count, const std::uint8_t *data)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+
+			size_t done = 0;
+			while (count)
+			{
+				size_t chunk = lba / m_chunk_lba;
+				size_t index = lba % m_chunk_lba;
+				size_t length = std::min(count, m_chunk_lba - index);
+
+				std::uint32_t slot = lookup(chunk);
+				if (!slot)
+				{
+					slot = allocate(chunk, index, length, data);
+					if (!slot)
+					{
+						break;
+					}
+				}
+				else
+				if (write_slot(slot - 1, index, length, data) != length * sector_size)
+				{
+					break;
+				}
+
+				done += length * sector_size;
+				data += length * sector_size;
+				lba += length;
+				count -= length;
+			}
+			return done;
+		}
+
+		/**
+		 * @brief Sync chunk data and slot table, then publish the new slot count
+		 */
+		virtual bool flush()
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+
+			if (m_used == m_committed)
+			{
+				return !::fdatasync(m_fd);
+			}
+
+			if (::fdatasync(m_fd))
+			{
+				return false;
+			}
+
+			std::uint64_t used = m_used;
+			if (::pwrite(m_fd, &used, sizeof(used), offsetof(header_t, used)) != sizeof(used))
+			{
+				return false;
+			}
+
+			if (::fdatasync(m_fd))
+			{
+				return false;
+			}
+			m_committed = used;
+			return true;
+		}
+
+	protected:
+		struct leaf_t
+		{
+			std::uint32_t slot[leaf_size];
+		};
+
+		interface::drive &m_base;
+		int m_fd;
+		size_t m_chunk_size;
+		size_t m_chunk_lba;
+		size_t m_chunks;
+		size_t m_data_offset;
+
+		/**
+		 * @brief Radix table chunk -> slot + 1, leaves are allocated on first use
+		 */
+		std::vector< std::unique_ptr<leaf_t> > m_index;
+		std::atomic<size_t> m_used;
+		size_t m_committed;
+		std::mutex m_mutex;
+
+		std::uint32_t lookup(size_t chunk) const
+		{
+			if (chunk >= m_chunks)
+			{
+				return 0;
+			}
+
+			const std::unique_ptr<leaf_t> &leaf = m_index[chunk >> leaf_bits];
+			return leaf ? leaf->slot[chunk & (leaf_size - 1)] : 0;
+		}
+
+		void insert(size_t chunk, size_t slot)
+		{
+			std::unique_ptr<leaf_t> &leaf = m_index[chunk >> leaf_bits];
+			if (!leaf)
+			{
+				leaf.reset(new leaf_t());
+			}
+			leaf->slot[chunk & (leaf_size - 1)] = slot + 1;
+		}
+
+		/**
+		 * @brief Copy chunk from base, merge new data and redirect it
+		 * @return slot + 1, 0 on error
+		 */
+		std::uint32_t allocate(size_t chunk, size_t index, size_t count, const std::uint8_t *data)
+		{
+			std::vector<std::uint8_t> buffer(m_chunk_size, 0);
+			size_t lba = chunk * m_chunk_lba;
+			size_t length = std::min(m_chunk_lba, m_base.size() / sector_size - lba);
+
+			if ((index || (count < m_chunk_lba)) && (m_base.read(lba, length, &buffer[0]) != length * sector_size))
+			{
+				return 0;
+			}
+			memcpy(&buffer[index * sector_size], data, count * sector_size);
+
+			size_t slot = m_used;
+			if (write_slot(slot, 0, m_chunk_lba, &buffer[0]) != m_chunk_size)
+			{
+				return 0;
+			}
+
+			std::uint64_t entry = chunk;
+			if (::pwrite(m_fd, &entry, sizeof(entry), header_size + slot * sizeof(entry)) != sizeof(entry))
+			{
+				return 0;
+			}
+
+			insert(chunk, slot);
+			m_used.store(slot + 1, std::memory_order_release);
+			return slot + 1;
+		}
+
+		size_t read_slot(size_t slot, size_t index, size_t count, std::uint8_t *data)
+		{
+			return raidfuse::drive::read_fully(m_fd, data, count * sector_size, m_data_offset + slot * m_chunk_size + index * sector_size);
+		}
+
+		size_t write_slot(size_t slot, size_t index, size_t count, const std::uint8_t *data)
+		{
+			return raidfuse::drive::write_fully(m_fd, data, count * sector_size, m_data_offset + slot * m_chunk_size + index * sector_size);
+		}
+};
+
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RAIDFUSE_PARITY_X86
+#endif
+
+namespace raidfuse { namespace parity {
+
+namespace detail {
+
+inline size_t xor_generic(std::uint8_t *destination, const std::uint8_t *source, size_t size)
+{
+	size_t index = 0;
+	for (; index + sizeof(std::uint64_t) <= size; index += sizeof(std::uint64_t))
+	{
+		std::uint64_t a, b;
+		memcpy(&a, destination + index, sizeof(a));
+		memcpy(&b, source + index, sizeof(b));
+		a ^= b;
+		memcpy(destination + index, &a, sizeof(a));
+	}
+	return index;
+}
+
+inline bool zero_generic(const std::uint8_t *data, size_t size, size_t &index)
+{
+	std::uint64_t result = 0;
+	for (index = 0; index + sizeof(std::uint64_t) <= size; index += sizeof(std::uint64_t))
+	{
+		std::uint64_t value;
+		memcpy(&value, data + index, sizeof(value));
+		result |= value;
+	}
+	return !result;
+}
+
+#ifdef RAIDFUSE_PARITY_X86
+__attribute__((target("avx2")))
+inline size_t xor_avx2(std::uint8_t *destination, const std::uint8_t *source, size_t size)
+{
+	size_t index = 0;
+	for (; index + 4 * sizeof(__m256i) <= size; index += 4 * sizeof(__m256i))
+	{
+		__m256i *d = (__m256i *)(destination + index);
+		const __m256i *s = (const __m256i *)(source + index);
+		_mm256_storeu_si256(d + 0, _mm256_xor_si256(_mm256_loadu_si256(d + 0), _mm256_loadu_si256(s + 0)));
+		_mm256_storeu_si256(d + 1, _mm256_xor_si256(_mm256_loadu_si256(d + 1), _mm256_loadu_si256(s + 1)));
+		_mm256_storeu_si256(d + 2, _mm256_xor_si256(_mm256_loadu_si256(d + 2), _mm256_loadu_si256(s + 2)));
+		_mm256_storeu_si256(d + 3, _mm256_xor_si256(_mm256_loadu_si256(d + 3), _mm256_loadu_si256(s + 3)));
+	}
+	return index;
+}
+
+__attribute__((target("avx2")))
+inline bool zero_avx2(const std::uint8_t *data, size_t size, size_t &index)
+{
+	__m256i result = _mm256_setzero_si256();
+	for (index = 0; index + sizeof(__m256i) <= size; index += sizeof(__m256i))
+	{
+		result = _mm256_or_si256(result, _mm256_loadu_si256((const __m256i *)(data + index)));
+	}
+	return _mm256_testz_si256(result, result);
+}
+
+__attribute__((target("sse2")))
+inline size_t xor_sse2(std::uint8_t *destination, const std::uint8_t *source, size_t size)
+{
+	size_t index = 0;
+	for (; index + 4 * sizeof(__m128i) <= size; index += 4 * sizeof(__m128i))
+	{
+		__m128i *d = (__m128i *)(destination + index);
+		const __m128i *s = (const __m128i *)(source + index);
+		_mm_storeu_si128(d + 0, _mm_xor_si128(_mm_loadu_si128(d + 0), _mm_loadu_si128(s + 0)));
+		_mm_storeu_si128(d + 1, _mm_xor_si128(_mm_loadu_si128(d + 1), _mm_loadu_si128(s + 1)));
+		_mm_storeu_si128(d + 2, _mm_xor_si128(_mm_loadu_si128(d + 2), _mm_loadu_si128(s + 2)));
+		_mm_storeu_si128(d + 3, _mm_xor_si128(_mm_loadu_si128(d + 3), _mm_loadu_si128(s + 3)));
+	}
+	return index;
+}
+
+inline bool has_avx2()
+{
+	static const bool result = __builtin_cpu_supports("avx2");
+	return result;
+}
+#endif
+
+}
+
+/**
+ * @brief XOR source into destination
+ *
+ * Uses AVX2 or SSE2 when the CPU supports it, selected at runtime.
+ */
+inline void xor_into(std::uint8_t *destination, const std::uint8_t *source, size_t size)
+{
+#ifdef RAIDFUSE_PARITY_X86
+	size_t index = detail::has_avx2() ? detail::xor_avx2(destination, source, size) : detail::xor_sse2(destination, source, size);
+	index += detail::xor_generic(destination + index, source + index, size - index);
+#else
+	size_t index = detail::xor_generic(destination, source, size);
+#endif
+	for (; index < size; index++)
+	{
+		destination[index] ^= source[index];
+	}
+}
+
+/**
+ * @brief Check buffer for all bytes zero
+ */
+inline bool is_zero(const std::uint8_t *data, size_t size)
+{
+	size_t index;
+#ifdef RAIDFUSE_PARITY_X86
+	bool result = detail::has_avx2() ? detail::zero_avx2(data, size, index) : detail::zero_generic(data, size, index);
+#else
+	bool result = detail::zero_generic(data, size, index);
+#endif
+	for (; result && (index < size); index++)
+	{
+		result = !data[index];
+	}
+	return result;
+}
+
+} }
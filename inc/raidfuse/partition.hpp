@@ -10,6 +10,8 @@ class partition:
 	public interface::drive
 {
 	public:
+		using interface::drive::read;
+
 		partition(interface::drive &drive, std::string name, size_t start, size_t end):
 			m_drive(drive),
 			m_name(name),
@@ -24,9 +26,29 @@ class partition:
 			return ((m_end - m_start) + 1) * sector_size;
 		}
 
-		virtual size_t read(size_t lba, uint8_t *data)
+		virtual size_t logical_block_size()
+		{
+			return m_drive.logical_block_size();
+		}
+
+		virtual size_t physical_block_size()
+		{
+			return m_drive.physical_block_size();
+		}
+
+		virtual size_t read(size_t lba, size_t count, std::uint8_t *data)
 		{
-			return m_drive.read(lba + m_start, data);
+			return m_drive.read(lba + m_start, count, data);
+		}
+
+		virtual size_t write(size_t lba, size_t count, const std::uint8_t *data)
+		{
+			return m_drive.write(lba + m_start, count, data);
+		}
+
+		virtual bool flush()
+		{
+			return m_drive.flush();
 		}
 
 		std::string name() const
@@ -34,6 +56,9 @@ class partition:
 			return m_name;
 		}
 
+		size_t start() const { return m_start; }
+		size_t end() const { return m_end; }
+
 	protected:
 		interface::drive &m_drive;
 		std::string m_name;
@@ -1,8 +1,24 @@
 #pragma once
 
+#include <map>
+#include <mutex>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <vector>
+#include <string>
+#include <iostream>
+#include <algorithm>
 
 #include <raidfuse/drive.hpp>
+#include <raidfuse/parity.hpp>
+#include <raidfuse/latency.hpp>
+#include <raidfuse/executor.hpp>
+#include <raidfuse/badblocks.hpp>
+#include <raidfuse/buffer.hpp>
+#include <raidfuse/layout.hpp>
+#include <raidfuse/scheduler.hpp>
 
 namespace raidfuse {
 
@@ -10,21 +26,72 @@ class raid5:
 	public interface::drive
 {
 	public:
+		using interface::drive::read;
+
 		raid5(const size_t stripe = 32 * 1024):
 			m_stripe_size(stripe),
 			m_stripe_lba(stripe / sector_size),
+			m_buffers(stripe),
 			m_count(0),
+			m_logical_block(sector_size),
+			m_physical_block(sector_size),
 			m_physical_size(0),
 			m_logical_size(0),
 			m_physical_lba(0),
 			m_logical_lba(0),
 			m_physical_sequence(0),
-			m_logical_sequence(0)
+			m_logical_sequence(0),
+			m_geometry(),
+			m_kernel(layout::select(0, 0)),
+			m_writable(false),
+			m_write_rows(64),
+			m_journal(-1),
+			m_executor(nullptr),
+			m_hedging(false),
+			m_hedge_deadline(0),
+			m_hedge_percentile(0),
+			m_hedge_group(0),
+			m_hedge_current(0),
+			m_hedge_reads(0),
+			m_hedged(0),
+			m_reconstructed(0),
+			m_hedge_free(nullptr),
+			m_retries(2),
+			m_retry_lba(8),
+			m_backoff(10),
+			m_recovered(0),
+			m_verify(false),
+			m_rows(0),
+			m_verified_rows(0),
+			m_unverified_rows(0),
+			m_mismatches(0),
+			m_verify_tick(0),
+			m_readers(0),
+			m_committing(false)
 		{
 
 		}
 
+		virtual ~raid5()
+		{
+			if (m_journal >= 0)
+			{
+				::close(m_journal);
+			}
+		}
+
 		size_t count() const { return m_count; }
+		size_t stripe_size() const { return m_stripe_size; }
+
+		/**
+		 * @brief Largest logical block size of the members, partition tables count in this unit
+		 */
+		virtual size_t logical_block_size() { return m_logical_block; }
+
+		/**
+		 * @brief Largest physical block size of the members
+		 */
+		virtual size_t physical_block_size() { return m_physical_block; }
 		size_t physical_size() const { return m_physical_size; }
 		size_t logical_size() const { return m_logical_size; }
 		size_t physical_lba() const { return m_physical_lba; }
@@ -32,12 +99,34 @@ class raid5:
 
 		void add(raidfuse::drive &drv)
 		{
+			if (!m_schedulers.empty())
+			{
+				throw std::runtime_error("Can not add drive after scheduling!");
+			}
+
 			/* Check sector boundary */
 			if (drv.size() % sector_size)
 			{
 				throw std::runtime_error("Drive size out of sector boundary!");
 			}
 
+			/* Check block boundary, chunks have to start at a member block */
+			if (m_stripe_size % drv.logical_block_size())
+			{
+				throw std::runtime_error("Chunk size out of drive block boundary!");
+			}
+
+			/* Partial blocks are bounced through buffers of one chunk, larger physical blocks are only done in pieces */
+			size_t physical = drv.physical_block_size();
+			while (m_stripe_size % physical)
+			{
+				physical /= 2;
+			}
+			if (physical != drv.physical_block_size())
+			{
+				std::clog << "Physical block size " << drv.physical_block_size() << " of drive larger than chunk, using " << physical << " Bytes" << std::endl;
+			}
+
 			/* Check stripe boundary */
 			if (drv.size() % m_stripe_size)
 			{
@@ -53,10 +142,259 @@ class raid5:
 				}
 			}
 
+			m_writable = (m_drives.empty() || m_writable) && drv.writable();
+			m_logical_block = std::max(m_logical_block, drv.logical_block_size());
+			m_physical_block = std::max(m_physical_block, physical);
+			m_retry_lba = block_aligned(m_retry_lba);
 			m_drives.push_back(&drv);
 			calculate();
 		}
 
+		/**
+		 * @brief Queue member reads, so concurrent reads are sorted and merged
+		 *
+		 * Has to be called after all members are added.
+		 *
+		 * @param depth transfers issued to a member at the same time
+		 * @param deadline maximum time a read is passed over
+		 * @param max_size largest merged transfer in bytes
+		 */
+		void schedule(size_t depth, std::chrono::microseconds deadline, size_t max_size = 1024 * 1024)
+		{
+			for (interface::drive *&drive: m_drives)
+			{
+				m_schedulers.push_back(std::unique_ptr<scheduler>(new scheduler(*drive, depth, deadline, max_size)));
+				drive = m_schedulers.back().get();
+			}
+		}
+
+		/**
+		 * @brief Request queue of member, nullptr without scheduling
+		 */
+		scheduler *member_scheduler(size_t member) const
+		{
+			return (member < m_schedulers.size()) ? m_schedulers[member].get() : nullptr;
+		}
+
+		/**
+		 * @brief Worker pool for member reads issued in parallel
+		 * @param group queue of the executor, for arrays sharing it
+		 */
+		void workers(executor &executor, size_t group = 0)
+		{
+			m_executor = &executor;
+			m_hedge_group = group;
+		}
+
+		/**
+		 * @brief Serve slow member reads from the other members plus parity
+		 *
+		 * A member read still pending after the deadline is raced against
+		 * reconstruction from the remaining members. With a percentile given,
+		 * the deadline grows to the median over all members of that latency
+		 * percentile, so one slow member does not raise its own limit.
+		 *
+		 * @param executor runs the member reads which may be overtaken
+		 * @param deadline minimum time to wait for a member
+		 * @param percentile 0 for fixed deadline, else e.g. 99
+		 * @param group queue of the executor, for arrays sharing it
+		 */
+		void hedge(executor &executor, std::chrono::microseconds deadline, double percentile = 0, size_t group = 0)
+		{
+			workers(executor, group);
+
+			/* Hedge states are allocated once, reads find none free are not hedged */
+			size_t slots = std::max(4 * executor.threads(), (size_t)16);
+			m_hedge_slots.reset(new hedge_t[slots]);
+			m_hedge_free = nullptr;
+			for (size_t index = 0; index < slots; index++)
+			{
+				m_hedge_slots[index].next = m_hedge_free;
+				m_hedge_free = &m_hedge_slots[index];
+			}
+
+			m_hedging = true;
+			m_hedge_deadline = deadline;
+			m_hedge_percentile = percentile;
+			m_hedge_current = std::chrono::nanoseconds(deadline).count();
+			m_hedge_reads = 0;
+		}
+
+		/**
+		 * @brief Latency histogram of member reads
+		 */
+		const latency &member_latency(size_t member) const { return *m_latency[member]; }
+
+		/**
+		 * @brief Member reads which passed the hedge deadline
+		 */
+		size_t hedged() const { return m_hedged; }
+
+		/**
+		 * @brief Hedged reads served by reconstruction
+		 */
+		size_t reconstructed() const { return m_reconstructed; }
+
+		/**
+		 * @brief Configure handling of member read errors
+		 *
+		 * A failed member read is retried piece by piece with exponential
+		 * backoff. Pieces still failing are reconstructed from the other
+		 * members and recorded as bad, later reads skip them on that member.
+		 *
+		 * @param retries additional attempts per piece
+		 * @param granularity piece size in bytes, rounded up to the member block size
+		 * @param backoff delay before first retry, doubled on each further one
+		 */
+		void recovery(size_t retries, size_t granularity, std::chrono::milliseconds backoff)
+		{
+			m_retries = retries;
+			m_retry_lba = block_aligned(std::max(granularity / sector_size, (size_t)1));
+			m_backoff = backoff;
+		}
+
+		/**
+		 * @brief Ranges given up on, reads go straight to reconstruction
+		 */
+		raidfuse::badblocks &badblocks() { return m_badblocks; }
+
+		/**
+		 * @brief Sectors served by reconstruction after read errors
+		 */
+		size_t recovered() const { return m_recovered; }
+
+		/**
+		 * @brief Verify parity of each stripe row on first read
+		 *
+		 * The complete row is read once, from all members in parallel when
+		 * workers are set, and checked. The last few checked rows are kept,
+		 * so sequential reads only pay for the parity chunk. Different rows
+		 * are checked at the same time. A bitmap remembers checked rows for
+		 * the rest of the session.
+		 */
+		void verify(bool enable)
+		{
+			std::lock_guard<std::mutex> lock(m_verify_mutex);
+
+			m_verify = enable;
+			m_rows = m_count ? (m_drives.front()->size() + m_stripe_size - 1) / m_stripe_size : 0;
+			m_verified.reset(new std::atomic<std::uint64_t>[(m_rows + 63) / 64]);
+			for (size_t index = 0; index < (m_rows + 63) / 64; index++)
+			{
+				m_verified[index] = 0;
+			}
+
+			m_verify_slots.reset(enable ? new verify_t[verify_rows] : nullptr);
+			for (size_t slot = 0; enable && (slot < verify_rows); slot++)
+			{
+				verify_t &entry = m_verify_slots[slot];
+				entry.row = no_row;
+				entry.ready = false;
+				entry.complete = false;
+				entry.users = 0;
+				entry.used = 0;
+				entry.pending = 0;
+				entry.data.resize(m_count * m_stripe_size);
+				entry.jobs.resize(m_count);
+				for (size_t member = 0; member < m_count; member++)
+				{
+					entry.jobs[member].entry = &entry;
+					entry.jobs[member].member = member;
+				}
+			}
+		}
+
+		/**
+		 * @brief Rows checked so far
+		 */
+		size_t verified_rows() const { return m_verified_rows; }
+
+		/**
+		 * @brief Rows which could not be checked, because a member failed to read
+		 */
+		size_t unverified_rows() const { return m_unverified_rows; }
+
+		/**
+		 * @brief Rows with parity mismatch
+		 */
+		size_t mismatches() const { return m_mismatches; }
+
+		/**
+		 * @brief First mismatching rows, at most max_mismatch_rows
+		 */
+		std::vector<size_t> mismatch_rows()
+		{
+			std::lock_guard<std::mutex> lock(m_verify_mutex);
+			return m_mismatch_rows;
+		}
+
+		/**
+		 * @brief Pool of chunk sized buffers used for reconstruction, parity and checks
+		 */
+		buffer_pool &buffers() { return m_buffers; }
+
+		/**
+		 * @brief Maximum number of buffered stripe rows before they are committed
+		 */
+		void write_buffer(size_t rows)
+		{
+			m_write_rows = std::max(rows, (size_t)1);
+		}
+
+		/**
+		 * @brief Use write intent journal and resync rows left over by a crash
+		 *
+		 * Rows are recorded and synced to the journal before any member is
+		 * written and removed after all members are synced, so a crash in
+		 * between leaves the affected rows listed for parity resync.
+		 */
+		void journal(const std::string &filename)
+		{
+			int fd = ::open(filename.c_str(), (m_writable ? O_RDWR : O_RDONLY) | O_CREAT, 0644);
+			if (fd < 0)
+			{
+				throw std::runtime_error("Error opening journal '" + filename + "'");
+			}
+
+			std::vector<std::uint64_t> rows;
+			std::uint64_t row;
+			while (::read(fd, &row, sizeof(row)) == sizeof(row))
+			{
+				rows.push_back(row);
+			}
+
+			if (rows.size())
+			{
+				if (!m_writable)
+				{
+					::close(fd);
+					throw std::runtime_error("Journal '" + filename + "' lists rows with stale parity, resync needs write access!");
+				}
+
+				for (std::uint64_t row: rows)
+				{
+					if (!resync(row))
+					{
+						::close(fd);
+						throw std::runtime_error("Parity resync failed!");
+					}
+				}
+
+				if (!std::all_of(m_drives.begin(), m_drives.end(), [](interface::drive *drive) { return drive->flush(); }))
+				{
+					::close(fd);
+					throw std::runtime_error("Parity resync failed!");
+				}
+			}
+
+			if (m_writable && (::ftruncate(fd, 0) || ::fdatasync(fd)))
+			{
+				::close(fd);
+				throw std::runtime_error("Error clearing journal '" + filename + "'");
+			}
+			m_journal = fd;
+		}
+
 		size_t physical(size_t lba, std::uint8_t *data)
 		{
 			size_t stripe_index = lba / m_stripe_lba;
@@ -75,62 +413,187 @@ class raid5:
 			return m_logical_size;
 		}
 
-		virtual size_t read(size_t lba, std::uint8_t *data)
+		/**
+		 * @brief Read consecutive sectors, split at stripe boundaries
+		 */
+		virtual size_t read(size_t lba, size_t count, std::uint8_t *data)
+		{
+			if (m_writable)
+			{
+				/* Members are read without holding the write buffer */
+				reading guard(*this);
+
+				size_t done = read_members(lba, count, data);
+				if (done == count * sector_size)
+				{
+					std::lock_guard<std::mutex> lock(m_mutex);
+					overlay(lba, count, data);
+				}
+				return done;
+			}
+			return read_members(lba, count, data);
+		}
+
+		/**
+		 * @brief Buffer write, rows are committed when buffer is full or on flush
+		 */
+		virtual size_t write(size_t lba, size_t count, const std::uint8_t *data)
+		{
+			if (!m_writable)
+			{
+				return 0;
+			}
+
+			size_t done = 0;
+			bool full;
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+
+				size_t row_lba = m_stripe_lba * (m_count - 1);
+				while (count)
+				{
+					size_t row = lba / row_lba;
+					size_t index = lba % row_lba;
+					size_t length = std::min(count, row_lba - index);
+
+					row_t &entry = m_dirty[row];
+					if (entry.data.empty())
+					{
+						entry.data.resize(row_lba * sector_size);
+						entry.valid.resize(row_lba, false);
+						entry.filled = 0;
+					}
+
+					memcpy(&entry.data[index * sector_size], data, length * sector_size);
+					for (size_t sector = index; sector < index + length; sector++)
+					{
+						if (!entry.valid[sector])
+						{
+							entry.valid[sector] = true;
+							entry.filled++;
+						}
+					}
+
+					done += length * sector_size;
+					data += length * sector_size;
+					lba += length;
+					count -= length;
+				}
+				full = (m_dirty.size() > m_write_rows);
+			}
+
+			if (full && !commit_exclusive())
+			{
+				return 0;
+			}
+			return done;
+		}
+
+		/**
+		 * @brief Commit buffered rows and sync members
+		 */
+		virtual bool flush()
+		{
+			if (!m_writable)
+			{
+				return true;
+			}
+			return commit_exclusive();
+		}
+
+		/**
+		 * @brief Locate logical chunk on the members
+		 * @param chunk logical chunk index
+		 * @param drive member holding the chunk
+		 * @param row stripe row, which is also the chunk index on the member
+		 */
+		void locate(size_t chunk, size_t &drive, size_t &row)
+		{
+			m_kernel.map(m_geometry, chunk, drive, row);
+		}
+
+		/**
+		 * @brief Mapping is specialized for member count and chunk size
+		 */
+		bool specialized() const { return m_kernel.specialized; }
+
+		/**
+		 * @brief Member holding parity of stripe row
+		 */
+		size_t parity_drive(size_t row) const
 		{
-			size_t stripe_lba = lba / m_stripe_lba;
-			size_t stripe_index = lba % m_stripe_lba;
+			return m_count - (row % m_count) - 1;
+		}
 
-			size_t logical_lba, drive, stripe;
-			map(stripe_lba, logical_lba, drive, stripe);
+	protected:
+		/**
+		 * @brief Read consecutive sectors from members, split at stripe boundaries
+		 */
+		size_t read_members(size_t lba, size_t count, std::uint8_t *data)
+		{
+			size_t done = 0;
+			while (count)
+			{
+				size_t drive, drive_lba;
+				size_t length = std::min(count, m_kernel.split(m_geometry, lba, drive, drive_lba));
 
-			size_t drive_lba = stripe * m_stripe_lba + stripe_index;
+				size_t result;
+				if (!m_verify || !read_verified(drive, drive_lba / m_stripe_lba, drive_lba % m_stripe_lba, length, data, result))
+				{
+					result = read_member(drive, drive_lba, length, data);
+				}
 
-		//	std::cout << std::setw(4) << lba << std::setw(4) << stripe_lba << std::setw(4) << logical_lba << std::setw(4) << drive << std::setw(4) << drive_lba << std::endl;
+				done += result;
+				if (result != length * sector_size)
+				{
+					break;
+				}
 
-			return m_drives[drive]->read(drive_lba, data);
+				data += result;
+				lba += length;
+				count -= length;
+			}
+			return done;
 		}
 
+	public:
 		/**
 		 * @brief Check parity of each stripe/sector/byte
 		 * @return false on error, true on success
 		 */
 		bool check()
 		{
-			std::vector< std::vector<std::uint8_t> > buffer;
-			buffer.resize(m_count);
+			std::vector<buffer_pool::buffer> buffer;
 			for (size_t index = 0; index < m_count; index++)
 			{
-				buffer[index].resize(sector_size);
+				buffer.push_back(m_buffers.allocate());
 			}
 
-			bool result = true;
-			for (size_t logical_lba = 0; logical_lba < m_physical_lba && result; logical_lba++)
+			size_t member_lba = m_physical_lba / m_count;
+			for (size_t lba = 0; lba < member_lba; lba += m_stripe_lba)
 			{
-				size_t drive = logical_lba % m_count;
-				size_t physical_lba = logical_lba / m_count;
+				size_t count = std::min(m_stripe_lba, member_lba - lba);
+				size_t length = count * sector_size;
 
-				m_drives[drive]->read(physical_lba, &buffer[drive][0]);
-
-				/* Last drive of raid -> check */
-				if (drive == m_count - 1)
+				for (size_t drive = 0; drive < m_count; drive++)
 				{
-					for (size_t index = 0; index < sector_size; index++)
+					if (m_drives[drive]->read(lba, count, buffer[drive].data()) != length)
 					{
-						std::uint8_t parity = 0;
-						for (size_t drive = 0; drive < m_count; drive++)
-						{
-							parity ^= buffer[drive][index];
-						}
-
-						if (parity)
-						{
-							result = false;
-							break;
-						}
+						return false;
 					}
 				}
+
+				for (size_t drive = 1; drive < m_count; drive++)
+				{
+					parity::xor_into(buffer[0].data(), buffer[drive].data(), length);
+				}
+
+				if (!parity::is_zero(buffer[0].data(), length))
+				{
+					return false;
+				}
 			}
-			return result;
+			return true;
 		}
 
 		/**
@@ -163,11 +626,15 @@ class raid5:
 	protected:
 		const size_t m_stripe_size;
 		const size_t m_stripe_lba;
+		buffer_pool m_buffers;
 
-		std::vector<raidfuse::drive *> m_drives;
+		std::vector<interface::drive *> m_drives;
+		std::vector< std::unique_ptr<scheduler> > m_schedulers;
 		std::vector<size_t> m_offset;
 
 		size_t m_count;
+		size_t m_logical_block;
+		size_t m_physical_block;
 		size_t m_physical_size;
 		size_t m_logical_size;
 		size_t m_physical_lba;
@@ -175,39 +642,954 @@ class raid5:
 		size_t m_physical_sequence;
 		size_t m_logical_sequence;
 
+		layout::geometry_t m_geometry;
+		layout::kernel_t m_kernel;
+
 		/**
-		 * @brief Check, if selected stripe is a parity stripe
-		 * @param stripe
-		 * @return
+		 * @brief Buffered stripe row, data in logical order
 		 */
-		bool is_parity_stripe(size_t stripe) const
+		struct row_t
 		{
-			size_t drive_number = stripe % m_count;
-			size_t drive_lba = stripe / m_count;
-			size_t parity_drive = m_count - (drive_lba % m_count) - 1;
+			std::vector<std::uint8_t> data;
+			std::vector<bool> valid;
+			size_t filled;
+		};
 
-			return (drive_number == parity_drive);
+		bool m_writable;
+		size_t m_write_rows;
+		int m_journal;
+
+		std::vector< std::unique_ptr<latency> > m_latency;
+		std::unique_ptr< std::atomic<size_t>[] > m_stalled;
+		executor *m_executor;
+		bool m_hedging;
+		std::chrono::microseconds m_hedge_deadline;
+		double m_hedge_percentile;
+		size_t m_hedge_group;
+		std::atomic<std::chrono::nanoseconds::rep> m_hedge_current;
+		std::atomic<size_t> m_hedge_reads;
+		std::unique_ptr<std::chrono::nanoseconds[]> m_hedge_values;
+		std::mutex m_hedge_deadline_mutex;
+		std::atomic<size_t> m_hedged;
+		std::atomic<size_t> m_reconstructed;
+
+		/**
+		 * @brief State shared with a member read which may outlive its caller
+		 *
+		 * Released by whichever of caller and member read finishes last.
+		 */
+		struct hedge_t
+		{
+			size_t member;
+			size_t lba;
+			size_t count;
+			buffer_pool::buffer buffer;
+			size_t result;
+			bool done;
+			bool stalled;
+			std::atomic<int> references;
+			std::mutex mutex;
+			std::condition_variable condition;
+			hedge_t *next;
+		};
+
+		std::unique_ptr<hedge_t[]> m_hedge_slots;
+		hedge_t *m_hedge_free;
+		std::mutex m_hedge_mutex;
+
+		size_t m_retries;
+		size_t m_retry_lba;
+		std::chrono::milliseconds m_backoff;
+		raidfuse::badblocks m_badblocks;
+		std::atomic<size_t> m_recovered;
+
+		static constexpr size_t no_row = (size_t)-1;
+		static constexpr size_t max_mismatch_rows = 1024;
+		static constexpr size_t hedge_refresh = 256;
+
+		static constexpr size_t verify_rows = 8;
+		static constexpr size_t verify_piece = 4096;
+
+		struct verify_t;
+
+		/**
+		 * @brief Read of one member for a row check, runs on the workers
+		 */
+		struct verify_job_t
+		{
+			verify_t *entry;
+			size_t member;
+		};
+
+		/**
+		 * @brief Row being checked or kept after the check
+		 */
+		struct verify_t
+		{
+			size_t row;
+			bool ready;
+			bool complete;
+			size_t users;
+			size_t used;
+			size_t pending;
+			size_t length;
+			std::vector<std::uint8_t> data;
+			std::vector<verify_job_t> jobs;
+		};
+
+		bool m_verify;
+		size_t m_rows;
+		std::unique_ptr< std::atomic<std::uint64_t>[] > m_verified;
+		std::atomic<size_t> m_verified_rows;
+		std::atomic<size_t> m_unverified_rows;
+		std::atomic<size_t> m_mismatches;
+		std::vector<size_t> m_mismatch_rows;
+		std::mutex m_verify_mutex;
+		std::condition_variable m_verify_condition;
+		std::unique_ptr<verify_t[]> m_verify_slots;
+		size_t m_verify_tick;
+
+		bool is_verified(size_t row) const
+		{
+			return m_verified[row / 64].load(std::memory_order_relaxed) & (1ULL << (row % 64));
 		}
 
 		/**
-		 * @brief Calculate stripe offset table
+		 * @brief Serve chunk part from checked rows, check row first if needed
+		 * @return false, if caller has to read from member itself
 		 */
-		void calculate()
+		bool read_verified(size_t member, size_t row, size_t index, size_t count, std::uint8_t *data, size_t &result)
 		{
-			m_offset.clear();
+			if (row >= m_rows)
+			{
+				return false;
+			}
 
-			m_count = m_drives.size();
-			if (m_count)
+			std::unique_lock<std::mutex> lock(m_verify_mutex);
+
+			verify_t *entry = nullptr;
+			verify_t *victim = nullptr;
+			for (size_t slot = 0; slot < verify_rows; slot++)
 			{
-				m_physical_size = m_count * m_drives.front()->size();
-				m_logical_size = m_physical_size - m_drives.front()->size();
+				verify_t &candidate = m_verify_slots[slot];
+				if (candidate.row == row)
+				{
+					entry = &candidate;
+					break;
+				}
+				if (!candidate.users && (!victim || (candidate.used < victim->used)))
+				{
+					victim = &candidate;
+				}
 			}
-			else
+
+			if (entry)
 			{
-				m_physical_size = 0;
-				m_logical_size = 0;
+				entry->users++;
+				m_verify_condition.wait(lock, [entry] { return entry->ready; });
 			}
-			m_physical_lba = m_physical_size / sector_size;
+			else
+			{
+				/* Checked before and no longer kept, or all slots busy */
+				if (is_verified(row) || !victim)
+				{
+					return false;
+				}
+
+				entry = victim;
+				entry->row = row;
+				entry->ready = false;
+				entry->users = 1;
+				lock.unlock();
+
+				check_row(*entry);
+
+				lock.lock();
+				entry->ready = true;
+				m_verify_condition.notify_all();
+			}
+
+			entry->used = ++m_verify_tick;
+			bool complete = entry->complete;
+			if (complete)
+			{
+				result = count * sector_size;
+				memcpy(data, &entry->data[member * m_stripe_size + index * sector_size], result);
+			}
+
+			/* Incomplete rows are left to the recovery path and not kept */
+			if (!--entry->users && !complete)
+			{
+				entry->row = no_row;
+				entry->used = 0;
+			}
+			return complete;
+		}
+
+		/**
+		 * @brief Read row from all members and check its parity
+		 * @note entry is owned by the caller until marked ready
+		 */
+		void check_row(verify_t &entry)
+		{
+			size_t row = entry.row;
+			size_t lba = row * m_stripe_lba;
+			entry.length = std::min(m_stripe_lba, m_drives.front()->size() / sector_size - lba);
+			entry.complete = true;
+
+			if (m_executor && (m_count > 1))
+			{
+				{
+					std::lock_guard<std::mutex> lock(m_verify_mutex);
+					entry.pending = m_count - 1;
+				}
+				for (size_t member = 1; member < m_count; member++)
+				{
+					verify_job_t *job = &entry.jobs[member];
+					m_executor->submit([this, job]()
+					{
+						bool complete = read_row_member(*job->entry, job->member);
+
+						std::lock_guard<std::mutex> lock(m_verify_mutex);
+						job->entry->complete = job->entry->complete && complete;
+						if (!--job->entry->pending)
+						{
+							m_verify_condition.notify_all();
+						}
+					}, m_hedge_group);
+				}
+
+				bool complete = read_row_member(entry, 0);
+
+				std::unique_lock<std::mutex> lock(m_verify_mutex);
+				m_verify_condition.wait(lock, [&entry] { return !entry.pending; });
+				entry.complete = entry.complete && complete;
+			}
+			else
+			{
+				for (size_t member = 0; (member < m_count) && entry.complete; member++)
+				{
+					entry.complete = read_row_member(entry, member);
+				}
+			}
+
+			/* Rows are checked once, unreadable ones are counted and left to the recovery path */
+			m_verified[row / 64].fetch_or(1ULL << (row % 64));
+			if (!entry.complete)
+			{
+				m_unverified_rows++;
+				std::clog << "verify: stripe row " << row << " unreadable, not verified" << std::endl;
+				return;
+			}
+			m_verified_rows++;
+
+			/* Parity is summed up in pieces on the stack, nothing to allocate */
+			size_t length = entry.length * sector_size;
+			bool zero = true;
+			for (size_t offset = 0; zero && (offset < length); offset += verify_piece)
+			{
+				std::uint8_t parity[verify_piece];
+				size_t piece = std::min(length - offset, sizeof(parity));
+				memcpy(parity, &entry.data[offset], piece);
+				for (size_t member = 1; member < m_count; member++)
+				{
+					parity::xor_into(parity, &entry.data[member * m_stripe_size + offset], piece);
+				}
+				zero = parity::is_zero(parity, piece);
+			}
+
+			if (!zero)
+			{
+				m_mismatches++;
+				std::clog << "verify: parity mismatch in stripe row " << row << std::endl;
+
+				std::lock_guard<std::mutex> lock(m_verify_mutex);
+				if (m_mismatch_rows.size() < max_mismatch_rows)
+				{
+					m_mismatch_rows.push_back(row);
+				}
+			}
+		}
+
+		bool read_row_member(verify_t &entry, size_t member)
+		{
+			size_t length = entry.length * sector_size;
+			return m_drives[member]->read(entry.row * m_stripe_lba, entry.length, &entry.data[member * m_stripe_size]) == length;
+		}
+
+		/**
+		 * @brief Read from member, known bad ranges are reconstructed
+		 */
+		size_t read_member(size_t member, size_t lba, size_t count, std::uint8_t *data)
+		{
+			size_t done = 0;
+			size_t last = lba + count;
+			size_t bad_lba, bad_count;
+			while (lba < last)
+			{
+				size_t length = last - lba;
+				bool bad = m_badblocks.next(member, lba, last, bad_lba, bad_count);
+				if (bad && (bad_lba == lba))
+				{
+					if (!reconstruct(member, lba, bad_count, data))
+					{
+						break;
+					}
+					m_recovered += bad_count;
+					length = bad_count;
+				}
+				else
+				{
+					if (bad)
+					{
+						length = bad_lba - lba;
+					}
+
+					if (read_clean(member, lba, length, data) != length * sector_size)
+					{
+						break;
+					}
+				}
+
+				done += length * sector_size;
+				data += length * sector_size;
+				lba += length;
+			}
+			return done;
+		}
+
+		/**
+		 * @brief Read from member, recover from read errors
+		 */
+		size_t read_clean(size_t member, size_t lba, size_t count, std::uint8_t *data)
+		{
+			size_t result;
+			if (m_hedging)
+			{
+				result = read_hedged(member, lba, count, data);
+			}
+			else
+			{
+				auto start = std::chrono::steady_clock::now();
+				result = m_drives[member]->read(lba, count, data);
+				m_latency[member]->record(std::chrono::steady_clock::now() - start);
+			}
+
+			if (result == count * sector_size)
+			{
+				return result;
+			}
+			return recover(member, lba, count, data, result / sector_size);
+		}
+
+		/**
+		 * @brief Round sector count up to whole member blocks
+		 */
+		size_t block_aligned(size_t count) const
+		{
+			size_t block_lba = m_logical_block / sector_size;
+			return (count + block_lba - 1) / block_lba * block_lba;
+		}
+
+		/**
+		 * @brief Retry failed read in pieces, reconstruct and record pieces which keep failing
+		 * @param valid number of sectors already read successfully
+		 */
+		size_t recover(size_t member, size_t lba, size_t count, std::uint8_t *data, size_t valid)
+		{
+			size_t last = lba + count;
+			size_t piece = lba + valid;
+			while (piece < last)
+			{
+				size_t length = std::min(m_retry_lba - (piece % m_retry_lba), last - piece);
+				std::uint8_t *buffer = data + (piece - lba) * sector_size;
+
+				bool success = false;
+				std::chrono::milliseconds delay = m_backoff;
+				for (size_t attempt = 0; (attempt < m_retries) && !success; attempt++)
+				{
+					std::this_thread::sleep_for(delay);
+					delay *= 2;
+					success = (m_drives[member]->read(piece, length, buffer) == length * sector_size);
+				}
+
+				if (!success)
+				{
+					if (!reconstruct(member, piece, length, buffer))
+					{
+						return (piece - lba) * sector_size;
+					}
+					m_badblocks.add(member, piece, length);
+					m_recovered += length;
+				}
+				piece += length;
+			}
+			return count * sector_size;
+		}
+
+		/**
+		 * @brief Current hedge deadline, recalculated every hedge_refresh reads
+		 *
+		 * A read finding another thread recalculating keeps the previous value.
+		 */
+		std::chrono::nanoseconds hedge_deadline()
+		{
+			if ((m_hedge_percentile > 0) && !(m_hedge_reads++ % hedge_refresh))
+			{
+				std::unique_lock<std::mutex> lock(m_hedge_deadline_mutex, std::try_to_lock);
+				if (lock.owns_lock())
+				{
+					m_hedge_current = calculate_hedge_deadline().count();
+				}
+			}
+			return std::chrono::nanoseconds(m_hedge_current.load(std::memory_order_relaxed));
+		}
+
+		/**
+		 * @brief Median of the latency percentiles of members with enough samples
+		 * @note called with m_hedge_deadline_mutex locked
+		 */
+		std::chrono::nanoseconds calculate_hedge_deadline()
+		{
+			std::chrono::nanoseconds deadline = m_hedge_deadline;
+			size_t values = 0;
+			for (const std::unique_ptr<latency> &tracker: m_latency)
+			{
+				if (tracker->count() >= 64)
+				{
+					m_hedge_values[values++] = tracker->percentile(m_hedge_percentile);
+				}
+			}
+			if (!values)
+			{
+				return deadline;
+			}
+
+			std::nth_element(&m_hedge_values[0], &m_hedge_values[values / 2], &m_hedge_values[values]);
+			return std::max(deadline, m_hedge_values[values / 2]);
+		}
+
+		/**
+		 * @brief Race member read against reconstruction
+		 *
+		 * Reads passing the deadline keep their member marked as stalled until
+		 * they complete. Stalled members are routed around without waiting and
+		 * without occupying further workers.
+		 */
+		size_t read_hedged(size_t member, size_t lba, size_t count, std::uint8_t *data)
+		{
+			size_t length = count * sector_size;
+
+			if (m_stalled[member] && stalled(member) == m_count && reconstruct(member, lba, count, data))
+			{
+				m_hedged++;
+				m_reconstructed++;
+				return length;
+			}
+
+			/* Without buffer or free state the read is not hedged */
+			buffer_pool::buffer buffer = m_buffers.try_allocate();
+			hedge_t *state = buffer.data() ? acquire_hedge() : nullptr;
+			if (!state)
+			{
+				return m_drives[member]->read(lba, count, data);
+			}
+			state->member = member;
+			state->lba = lba;
+			state->count = count;
+			state->buffer = std::move(buffer);
+			state->result = 0;
+			state->done = false;
+			state->stalled = false;
+			state->references = 2;
+
+			/* Two pointers fit into the std::function without allocation */
+			hedging guard(*this, state);
+			m_executor->submit([this, state]()
+			{
+				auto start = std::chrono::steady_clock::now();
+				size_t result = m_drives[state->member]->read(state->lba, state->count, state->buffer.data());
+				m_latency[state->member]->record(std::chrono::steady_clock::now() - start);
+
+				{
+					std::lock_guard<std::mutex> lock(state->mutex);
+					state->result = result;
+					state->done = true;
+					if (state->stalled)
+					{
+						m_stalled[state->member]--;
+					}
+					state->condition.notify_all();
+				}
+				release_hedge(state);
+			}, m_hedge_group);
+			guard.submitted();
+
+			size_t result = length;
+			{
+				std::unique_lock<std::mutex> lock(state->mutex);
+				if (state->condition.wait_for(lock, hedge_deadline(), [state] { return state->done; }))
+				{
+					result = state->result;
+					memcpy(data, state->buffer.data(), result);
+					lock.unlock();
+					release_hedge(state);
+					return result;
+				}
+				state->stalled = true;
+				m_stalled[member]++;
+			}
+			m_hedged++;
+
+			/* Reconstruct, unless another member stalls too, and give up as soon as the member has answered */
+			if ((stalled(member) == m_count) && reconstruct(member, lba, count, data, state))
+			{
+				m_reconstructed++;
+			}
+			else
+			{
+				std::unique_lock<std::mutex> lock(state->mutex);
+				state->condition.wait(lock, [state] { return state->done; });
+				result = state->result;
+				memcpy(data, state->buffer.data(), result);
+			}
+			release_hedge(state);
+			return result;
+		}
+
+		/**
+		 * @brief Returns the state of a read whose member read could not be submitted
+		 *
+		 * Drops the reference of the caller and the one meant for the member read.
+		 */
+		class hedging
+		{
+			public:
+				hedging(raid5 &raid, hedge_t *state):
+					m_raid(raid),
+					m_state(state),
+					m_submitted(false)
+				{
+
+				}
+
+				~hedging()
+				{
+					if (!m_submitted)
+					{
+						m_raid.release_hedge(m_state);
+						m_raid.release_hedge(m_state);
+					}
+				}
+
+				void submitted()
+				{
+					m_submitted = true;
+				}
+
+			protected:
+				raid5 &m_raid;
+				hedge_t *m_state;
+				bool m_submitted;
+		};
+
+		hedge_t *acquire_hedge()
+		{
+			std::lock_guard<std::mutex> lock(m_hedge_mutex);
+			hedge_t *state = m_hedge_free;
+			if (state)
+			{
+				m_hedge_free = state->next;
+			}
+			return state;
+		}
+
+		void release_hedge(hedge_t *state)
+		{
+			if (--state->references)
+			{
+				return;
+			}
+
+			state->buffer = buffer_pool::buffer();
+			std::lock_guard<std::mutex> lock(m_hedge_mutex);
+			state->next = m_hedge_free;
+			m_hedge_free = state;
+		}
+
+		/**
+		 * @brief First stalled member other than the given one
+		 * @return m_count, if there is none
+		 */
+		size_t stalled(size_t member) const
+		{
+			for (size_t index = 0; index < m_count; index++)
+			{
+				if ((index != member) && m_stalled[index])
+				{
+					return index;
+				}
+			}
+			return m_count;
+		}
+
+		/**
+		 * @brief Calculate sectors of one member from all other members
+		 * @param state abort once this pending read is done, may be null
+		 * @return false on read error or abort
+		 */
+		bool reconstruct(size_t member, size_t lba, size_t count, std::uint8_t *data, hedge_t *state = nullptr)
+		{
+			size_t length = count * sector_size;
+			buffer_pool::buffer buffer = m_buffers.try_allocate();
+			if (!buffer.data())
+			{
+				return false;
+			}
+
+			memset(data, 0, length);
+			for (size_t index = 0; index < m_count; index++)
+			{
+				if (index == member)
+				{
+					continue;
+				}
+
+				if (state)
+				{
+					std::lock_guard<std::mutex> lock(state->mutex);
+					if (state->done && (state->result == length))
+					{
+						return false;
+					}
+				}
+
+				size_t bad_lba, bad_count;
+				if (m_badblocks.next(index, lba, lba + count, bad_lba, bad_count) || (m_drives[index]->read(lba, count, buffer.data()) != length))
+				{
+					return false;
+				}
+				parity::xor_into(data, buffer.data(), length);
+			}
+			return true;
+		}
+		std::map<size_t, row_t> m_dirty;
+		std::mutex m_mutex;
+
+		/* Readers share the members, a commit waits for them and has the members alone */
+		std::mutex m_gate_mutex;
+		std::condition_variable m_gate;
+		size_t m_readers;
+		bool m_committing;
+
+		class reading
+		{
+			public:
+				reading(raid5 &raid):
+					m_raid(raid)
+				{
+					std::unique_lock<std::mutex> lock(m_raid.m_gate_mutex);
+					m_raid.m_gate.wait(lock, [this] { return !m_raid.m_committing; });
+					m_raid.m_readers++;
+				}
+
+				~reading()
+				{
+					std::lock_guard<std::mutex> lock(m_raid.m_gate_mutex);
+					if (!--m_raid.m_readers)
+					{
+						m_raid.m_gate.notify_all();
+					}
+				}
+
+			protected:
+				raid5 &m_raid;
+		};
+
+		/**
+		 * @brief Commit with members excluded from readers, new readers wait behind the commit
+		 */
+		bool commit_exclusive()
+		{
+			{
+				std::unique_lock<std::mutex> lock(m_gate_mutex);
+				m_gate.wait(lock, [this] { return !m_committing; });
+				m_committing = true;
+				m_gate.wait(lock, [this] { return !m_readers; });
+			}
+
+			bool result;
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				result = commit();
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(m_gate_mutex);
+				m_committing = false;
+			}
+			m_gate.notify_all();
+			return result;
+		}
+
+		/**
+		 * @brief Copy buffered sectors over data read from members
+		 */
+		void overlay(size_t lba, size_t count, std::uint8_t *data)
+		{
+			if (m_dirty.empty())
+			{
+				return;
+			}
+
+			size_t row_lba = m_stripe_lba * (m_count - 1);
+			auto item = m_dirty.lower_bound(lba / row_lba);
+			for (; (item != m_dirty.end()) && (item->first * row_lba < lba + count); ++item)
+			{
+				size_t first = std::max(lba, item->first * row_lba);
+				size_t last = std::min(lba + count, (item->first + 1) * row_lba);
+				for (size_t sector = first; sector < last; sector++)
+				{
+					size_t index = sector - item->first * row_lba;
+					if (item->second.valid[index])
+					{
+						memcpy(data + (sector - lba) * sector_size, &item->second.data[index * sector_size], sector_size);
+					}
+				}
+			}
+		}
+
+		/**
+		 * @brief Write all buffered rows in journal, member, sync order
+		 */
+		bool commit()
+		{
+			if (m_dirty.empty())
+			{
+				return true;
+			}
+
+			if (m_journal >= 0)
+			{
+				std::vector<std::uint64_t> rows;
+				for (auto &item: m_dirty)
+				{
+					rows.push_back(item.first);
+				}
+
+				size_t length = rows.size() * sizeof(std::uint64_t);
+				if ((::pwrite(m_journal, &rows[0], length, 0) != (ssize_t)length) || ::fdatasync(m_journal))
+				{
+					return false;
+				}
+			}
+
+			for (auto &item: m_dirty)
+			{
+				bool result = (item.second.filled == item.second.valid.size()) ? write_row(item.first, item.second) : update_row(item.first, item.second);
+				if (!result)
+				{
+					return false;
+				}
+			}
+
+			for (interface::drive *drive: m_drives)
+			{
+				if (!drive->flush())
+				{
+					return false;
+				}
+			}
+			m_dirty.clear();
+
+			/* Kept rows are outdated, commits have the members alone, so none is in use */
+			if (m_verify)
+			{
+				std::lock_guard<std::mutex> lock(m_verify_mutex);
+				for (size_t slot = 0; slot < verify_rows; slot++)
+				{
+					m_verify_slots[slot].row = no_row;
+					m_verify_slots[slot].used = 0;
+				}
+			}
+
+			if ((m_journal >= 0) && (::ftruncate(m_journal, 0) || ::fdatasync(m_journal)))
+			{
+				return false;
+			}
+			return true;
+		}
+
+		/**
+		 * @brief Write complete row, parity is calculated from new data only
+		 */
+		bool write_row(size_t row, const row_t &entry)
+		{
+			buffer_pool::buffer parity = m_buffers.try_allocate();
+			if (!parity.data())
+			{
+				return false;
+			}
+			memset(parity.data(), 0, m_stripe_size);
+
+			for (size_t index = 0; index < m_count - 1; index++)
+			{
+				const std::uint8_t *chunk = &entry.data[index * m_stripe_size];
+				parity::xor_into(parity.data(), chunk, m_stripe_size);
+
+				size_t drive, stripe;
+				locate(row * (m_count - 1) + index, drive, stripe);
+				if (m_drives[drive]->write(stripe * m_stripe_lba, m_stripe_lba, chunk) != m_stripe_size)
+				{
+					return false;
+				}
+			}
+
+			return m_drives[parity_drive(row)]->write(row * m_stripe_lba, m_stripe_lba, parity.data()) == m_stripe_size;
+		}
+
+		/**
+		 * @brief Read-modify-write of partial row
+		 *
+		 * Only the sector range covered by buffered data is read and written,
+		 * parity is updated with old ^ new of each touched chunk.
+		 */
+		bool update_row(size_t row, const row_t &entry)
+		{
+			size_t first = m_stripe_lba;
+			size_t last = 0;
+			for (size_t index = 0; index < entry.valid.size(); index++)
+			{
+				if (entry.valid[index])
+				{
+					first = std::min(first, index % m_stripe_lba);
+					last = std::max(last, index % m_stripe_lba + 1);
+				}
+			}
+
+			size_t count = last - first;
+			size_t length = count * sector_size;
+			size_t offset = row * m_stripe_lba + first;
+
+			buffer_pool::buffer parity = m_buffers.try_allocate();
+			buffer_pool::buffer buffer = m_buffers.try_allocate();
+			if (!parity.data() || !buffer.data())
+			{
+				return false;
+			}
+
+			size_t parity_member = parity_drive(row);
+			if (m_drives[parity_member]->read(offset, count, parity.data()) != length)
+			{
+				return false;
+			}
+
+			for (size_t index = 0; index < m_count - 1; index++)
+			{
+				size_t base = index * m_stripe_lba;
+				if (std::none_of(entry.valid.begin() + base + first, entry.valid.begin() + base + last, [](bool valid) { return valid; }))
+				{
+					continue;
+				}
+
+				size_t drive, stripe;
+				locate(row * (m_count - 1) + index, drive, stripe);
+				if (m_drives[drive]->read(offset, count, buffer.data()) != length)
+				{
+					return false;
+				}
+
+				parity::xor_into(parity.data(), buffer.data(), length);
+				for (size_t sector = first; sector < last; sector++)
+				{
+					if (entry.valid[base + sector])
+					{
+						memcpy(buffer.data() + (sector - first) * sector_size, &entry.data[(base + sector) * sector_size], sector_size);
+					}
+				}
+				parity::xor_into(parity.data(), buffer.data(), length);
+
+				if (m_drives[drive]->write(offset, count, buffer.data()) != length)
+				{
+					return false;
+				}
+			}
+
+			return m_drives[parity_member]->write(offset, count, parity.data()) == length;
+		}
+
+		/**
+		 * @brief Recalculate parity of row from its data chunks
+		 */
+		bool resync(size_t row)
+		{
+			buffer_pool::buffer parity = m_buffers.try_allocate();
+			buffer_pool::buffer buffer = m_buffers.try_allocate();
+			if (!parity.data() || !buffer.data())
+			{
+				return false;
+			}
+			memset(parity.data(), 0, m_stripe_size);
+
+			for (size_t index = 0; index < m_count - 1; index++)
+			{
+				size_t drive, stripe;
+				locate(row * (m_count - 1) + index, drive, stripe);
+				if (m_drives[drive]->read(stripe * m_stripe_lba, m_stripe_lba, buffer.data()) != m_stripe_size)
+				{
+					return false;
+				}
+				parity::xor_into(parity.data(), buffer.data(), m_stripe_size);
+			}
+
+			return m_drives[parity_drive(row)]->write(row * m_stripe_lba, m_stripe_lba, parity.data()) == m_stripe_size;
+		}
+
+		/**
+		 * @brief Check, if selected stripe is a parity stripe
+		 * @param stripe
+		 * @return
+		 */
+		bool is_parity_stripe(size_t stripe) const
+		{
+			size_t drive_number = stripe % m_count;
+			size_t drive_lba = stripe / m_count;
+			size_t parity_drive = m_count - (drive_lba % m_count) - 1;
+
+			return (drive_number == parity_drive);
+		}
+
+		/**
+		 * @brief Calculate stripe offset table
+		 */
+		void calculate()
+		{
+			m_offset.clear();
+
+			m_latency.clear();
+			for (size_t index = 0; index < m_drives.size(); index++)
+			{
+				m_latency.push_back(std::unique_ptr<latency>(new latency()));
+			}
+			m_hedge_values.reset(new std::chrono::nanoseconds[m_drives.size()]);
+			m_stalled.reset(new std::atomic<size_t>[m_drives.size()]);
+			for (size_t index = 0; index < m_drives.size(); index++)
+			{
+				m_stalled[index] = 0;
+			}
+
+			m_count = m_drives.size();
+			if (m_count)
+			{
+				m_physical_size = m_count * m_drives.front()->size();
+				m_logical_size = m_physical_size - m_drives.front()->size();
+			}
+			else
+			{
+				m_physical_size = 0;
+				m_logical_size = 0;
+			}
+			m_physical_lba = m_physical_size / sector_size;
 			m_logical_lba = m_logical_size / sector_size;
 			m_physical_sequence = m_count * m_count;
 			m_logical_sequence = m_physical_sequence - m_count;
@@ -224,6 +1606,12 @@ class raid5:
 					m_offset.push_back(value);
 				}
 			}
+
+			m_geometry.count = m_count;
+			m_geometry.stripe_lba = m_stripe_lba;
+			m_geometry.logical_sequence = m_logical_sequence;
+			m_geometry.offset = m_offset.data();
+			m_kernel = layout::select(m_count, m_stripe_lba);
 		}
 };
 
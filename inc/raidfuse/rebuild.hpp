@@ -0,0 +1,344 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdexcept>
+
+#include <raidfuse/interface.hpp>
+#include <raidfuse/parity.hpp>
+#include <raidfuse/buffer.hpp>
+
+namespace raidfuse {
+
+/**
+ * @brief Content of a missing raid5 member, computed from the surviving members
+ *
+ * Every sector of the missing member is the XOR of the same sector on all
+ * other members, independent of the parity rotation. The missing member
+ * itself is never accessed.
+ *
+ * Reading is streamed: from the first read on, every surviving member has
+ * its own thread reading it sequentially into a bounded ring of blocks. A
+ * block is XORed into the caller's buffer once all members filled it, so
+ * the members are read in parallel and each one without seeking. Reads
+ * outside of the ring window are served directly from the members.
+ */
+class rebuild:
+	public interface::drive
+{
+	public:
+		using interface::drive::read;
+
+		/**
+		 * @param members surviving members, at least two
+		 * @param buffer_size block read from each member at once
+		 * @param depth blocks of the ring, each holds one buffer per member
+		 */
+		rebuild(const std::vector<interface::drive *> &members, size_t buffer_size = 4 * 1024 * 1024, size_t depth = 8):
+			m_members(members),
+			m_buffer_lba(std::max(buffer_size / sector_size, (size_t)1)),
+			m_depth(std::max(depth, (size_t)1)),
+			m_buffers(m_buffer_lba * sector_size),
+			m_started(false),
+			m_stop(false),
+			m_start(0),
+			m_end(0),
+			m_window(0)
+		{
+			if (m_members.size() < 2)
+			{
+				throw std::runtime_error("Rebuild needs at least two surviving members!");
+			}
+
+			for (interface::drive *member: m_members)
+			{
+				if (member->size() != m_members.front()->size())
+				{
+					throw std::runtime_error("Surviving members differ in size!");
+				}
+			}
+		}
+
+		rebuild(const rebuild &) = delete;
+		rebuild &operator=(const rebuild &) = delete;
+
+		virtual ~rebuild()
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_stop = true;
+			}
+			m_condition.notify_all();
+
+			for (std::thread &thread: m_readers)
+			{
+				thread.join();
+			}
+		}
+
+		virtual size_t size()
+		{
+			return m_members.front()->size();
+		}
+
+		virtual size_t logical_block_size()
+		{
+			return m_members.front()->logical_block_size();
+		}
+
+		virtual size_t physical_block_size()
+		{
+			return m_members.front()->physical_block_size();
+		}
+
+		virtual size_t read(size_t lba, size_t count, std::uint8_t *data)
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			if (!m_started)
+			{
+				start(lba);
+			}
+
+			if (lba >= m_end)
+			{
+				return 0;
+			}
+			count = std::min(count, m_end - lba);
+
+			size_t done = 0;
+			while (count)
+			{
+				size_t index = (lba >= m_start) ? (lba - m_start) / m_buffer_lba : 0;
+				slot_t &slot = m_slots[index % m_depth];
+
+				if ((lba < m_start) || (index < m_window) || (index >= m_window + m_depth) || (slot.index != index))
+				{
+					/* Outside of ring window, up to next block boundary */
+					size_t length = std::min(count, (lba < m_start) ? m_start - lba : m_buffer_lba - (lba - m_start) % m_buffer_lba);
+					lock.unlock();
+					size_t result = read_direct(lba, length, data);
+					lock.lock();
+					if (result != length * sector_size)
+					{
+						return done + result;
+					}
+
+					done += result;
+					data += result;
+					lba += length;
+					count -= length;
+					continue;
+				}
+
+				slot.users++;
+				m_condition.wait(lock, [&] { return m_stop || (slot.filled == m_members.size()); });
+				if (m_stop || slot.failed)
+				{
+					release(slot, 0);
+					return done;
+				}
+
+				size_t offset = lba - slot.lba;
+				size_t length = std::min(count, slot.count - offset);
+				size_t bytes = length * sector_size;
+				lock.unlock();
+
+				memcpy(data, slot.buffers[0].data() + offset * sector_size, bytes);
+				for (size_t member = 1; member < m_members.size(); member++)
+				{
+					parity::xor_into(data, slot.buffers[member].data() + offset * sector_size, bytes);
+				}
+
+				lock.lock();
+				release(slot, length);
+
+				done += bytes;
+				data += bytes;
+				lba += length;
+				count -= length;
+			}
+			return done;
+		}
+
+		/**
+		 * @brief Rebuild is read-only, the missing member is never written
+		 */
+		virtual size_t write(size_t lba, size_t count, const std::uint8_t *data)
+		{
+			(void) lba;
+			(void) count;
+			(void) data;
+			throw std::runtime_error("Rebuild is read-only!");
+		}
+
+		virtual bool flush()
+		{
+			return true;
+		}
+
+	protected:
+		/**
+		 * @brief Block of the ring, filled by all member readers
+		 */
+		struct slot_t
+		{
+			size_t index;
+			size_t lba;
+			size_t count;
+			size_t filled;
+			size_t consumed;
+			size_t users;
+			bool failed;
+			std::vector<buffer_pool::buffer> buffers;
+		};
+
+		std::vector<interface::drive *> m_members;
+		const size_t m_buffer_lba;
+		const size_t m_depth;
+		buffer_pool m_buffers;
+
+		std::vector<slot_t> m_slots;
+		std::vector<std::thread> m_readers;
+		bool m_started;
+		bool m_stop;
+		size_t m_start;
+		size_t m_end;
+		size_t m_window;
+		std::mutex m_mutex;
+		std::condition_variable m_condition;
+
+		/**
+		 * @brief Start member readers at lba, called with m_mutex held
+		 */
+		void start(size_t lba)
+		{
+			m_started = true;
+			m_start = lba;
+			m_end = size() / sector_size;
+			m_window = 0;
+
+			m_slots.resize(m_depth);
+			for (size_t index = 0; index < m_depth; index++)
+			{
+				slot_t &slot = m_slots[index];
+				slot.index = index;
+				slot.lba = m_start + index * m_buffer_lba;
+				slot.count = (slot.lba < m_end) ? std::min(m_buffer_lba, m_end - slot.lba) : 0;
+				slot.filled = 0;
+				slot.consumed = 0;
+				slot.users = 0;
+				slot.failed = false;
+				for (size_t member = 0; member < m_members.size(); member++)
+				{
+					slot.buffers.push_back(m_buffers.allocate());
+				}
+			}
+
+			for (size_t member = 0; member < m_members.size(); member++)
+			{
+				m_readers.push_back(std::thread(&rebuild::reader, this, member));
+			}
+		}
+
+		/**
+		 * @brief Read member sequentially into the ring
+		 */
+		void reader(size_t member)
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			for (size_t index = 0; ; index++)
+			{
+				slot_t &slot = m_slots[index % m_depth];
+				m_condition.wait(lock, [&] { return m_stop || (slot.index == index); });
+				if (m_stop || !slot.count)
+				{
+					return;
+				}
+
+				size_t lba = slot.lba;
+				size_t count = slot.count;
+				lock.unlock();
+				bool complete = (m_members[member]->read(lba, count, slot.buffers[member].data()) == count * sector_size);
+				lock.lock();
+
+				slot.failed = slot.failed || !complete;
+				if (++slot.filled == m_members.size())
+				{
+					m_condition.notify_all();
+				}
+			}
+		}
+
+		/**
+		 * @brief Account for sectors taken from slot, hand it to next block once done
+		 * @note called with m_mutex held
+		 */
+		void release(slot_t &slot, size_t length)
+		{
+			slot.users--;
+			slot.consumed += length;
+			if (slot.users || (slot.consumed < slot.count) || slot.failed)
+			{
+				return;
+			}
+
+			slot.index += m_depth;
+			slot.lba = m_start + slot.index * m_buffer_lba;
+			slot.count = (slot.lba < m_end) ? std::min(m_buffer_lba, m_end - slot.lba) : 0;
+			slot.filled = 0;
+			slot.consumed = 0;
+
+			while (m_slots[m_window % m_depth].index != m_window)
+			{
+				m_window++;
+			}
+			m_condition.notify_all();
+		}
+
+		/**
+		 * @brief Read from all members one after another, for reads outside the ring
+		 */
+		size_t read_direct(size_t lba, size_t count, std::uint8_t *data)
+		{
+			buffer_pool::buffer buffer = m_buffers.allocate();
+
+			size_t done = 0;
+			while (count)
+			{
+				size_t length = std::min(count, m_buffer_lba);
+				size_t bytes = length * sector_size;
+
+				if (m_members.front()->read(lba, length, data) != bytes)
+				{
+					break;
+				}
+
+				bool complete = true;
+				for (size_t index = 1; (index < m_members.size()) && complete; index++)
+				{
+					complete = (m_members[index]->read(lba, length, buffer.data()) == bytes);
+					if (complete)
+					{
+						parity::xor_into(data, buffer.data(), bytes);
+					}
+				}
+				if (!complete)
+				{
+					break;
+				}
+
+				done += bytes;
+				data += bytes;
+				lba += length;
+				count -= length;
+			}
+			return done;
+		}
+};
+
+}
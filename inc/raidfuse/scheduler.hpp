@@ -0,0 +1,290 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+#include <raidfuse/interface.hpp>
+#include <raidfuse/buffer.hpp>
+
+namespace raidfuse {
+
+/**
+ * @brief Request queue in front of a member drive
+ *
+ * Reads of concurrent callers are collected while the member is busy and
+ * issued in ascending sector order, starting at the end of the previous
+ * transfer. Adjacent and overlapping requests are merged into one
+ * transfer. A request waiting longer than the deadline is served next,
+ * regardless of its position. There are no worker threads, waiting callers
+ * issue the transfers themselves. A single caller is never delayed.
+ *
+ * Writes and flushes bypass the queue.
+ */
+class scheduler:
+	public interface::drive
+{
+	public:
+		using interface::drive::read;
+
+		/**
+		 * @param drive member drive
+		 * @param depth transfers issued to the member at the same time
+		 * @param deadline maximum time a request is passed over
+		 * @param max_size largest merged transfer in bytes
+		 */
+		scheduler(interface::drive &drive, size_t depth = 1, std::chrono::microseconds deadline = std::chrono::milliseconds(50), size_t max_size = 1024 * 1024):
+			m_drive(drive),
+			m_depth(std::max(depth, (size_t)1)),
+			m_deadline(deadline),
+			m_max_lba(std::max(max_size / sector_size, (size_t)1)),
+			m_buffers(m_max_lba * sector_size),
+			m_active(0),
+			m_head(0),
+			m_requests(0),
+			m_transfers(0)
+		{
+
+		}
+
+		scheduler(const scheduler &) = delete;
+		scheduler &operator=(const scheduler &) = delete;
+
+		/**
+		 * @brief Pool of merge buffers
+		 */
+		buffer_pool &buffers() { return m_buffers; }
+
+		/**
+		 * @brief Number of queued reads
+		 */
+		size_t requests()
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			return m_requests;
+		}
+
+		/**
+		 * @brief Number of transfers issued for queued reads
+		 */
+		size_t transfers()
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			return m_transfers;
+		}
+
+		virtual size_t size()
+		{
+			return m_drive.size();
+		}
+
+		virtual size_t logical_block_size()
+		{
+			return m_drive.logical_block_size();
+		}
+
+		virtual size_t physical_block_size()
+		{
+			return m_drive.physical_block_size();
+		}
+
+		virtual size_t read(size_t lba, size_t count, std::uint8_t *data)
+		{
+			if (count > m_max_lba)
+			{
+				return m_drive.read(lba, count, data);
+			}
+
+			request_t request;
+			request.lba = lba;
+			request.count = count;
+			request.data = data;
+			request.result = 0;
+			request.done = false;
+			request.arrival = std::chrono::steady_clock::now();
+
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_requests++;
+			m_pending.push_back(&request);
+
+			while (!request.done)
+			{
+				if ((m_active < m_depth) && !m_pending.empty())
+				{
+					dispatch(lock);
+				}
+				else
+				{
+					m_condition.wait(lock);
+				}
+			}
+			return request.result;
+		}
+
+		virtual size_t write(size_t lba, size_t count, const std::uint8_t *data)
+		{
+			return m_drive.write(lba, count, data);
+		}
+
+		virtual bool flush()
+		{
+			return m_drive.flush();
+		}
+
+	protected:
+		struct request_t
+		{
+			size_t lba;
+			size_t count;
+			std::uint8_t *data;
+			size_t result;
+			bool done;
+			std::chrono::steady_clock::time_point arrival;
+		};
+
+		interface::drive &m_drive;
+		const size_t m_depth;
+		const std::chrono::microseconds m_deadline;
+		const size_t m_max_lba;
+		buffer_pool m_buffers;
+
+		std::vector<request_t *> m_pending;
+		size_t m_active;
+		size_t m_head;
+		size_t m_requests;
+		size_t m_transfers;
+		std::mutex m_mutex;
+		std::condition_variable m_condition;
+
+		/**
+		 * @brief Completes a batch on destruction, also when issuing it threw
+		 *
+		 * Requests not served keep result 0 and fail like a read error.
+		 */
+		class completion
+		{
+			public:
+				completion(scheduler &owner, std::unique_lock<std::mutex> &lock, const std::vector<request_t *> &batch):
+					m_owner(owner),
+					m_lock(lock),
+					m_batch(batch)
+				{
+					m_owner.m_active++;
+					m_owner.m_transfers++;
+					m_lock.unlock();
+				}
+
+				~completion()
+				{
+					m_lock.lock();
+					m_owner.m_active--;
+					for (request_t *request: m_batch)
+					{
+						request->done = true;
+					}
+					m_owner.m_condition.notify_all();
+				}
+
+			protected:
+				scheduler &m_owner;
+				std::unique_lock<std::mutex> &m_lock;
+				const std::vector<request_t *> &m_batch;
+		};
+
+		/**
+		 * @brief Take next batch of pending requests, issue it and complete it
+		 * @note called with m_mutex locked
+		 */
+		void dispatch(std::unique_lock<std::mutex> &lock)
+		{
+			std::vector<request_t *> batch = next();
+			completion guard(*this, lock, batch);
+			issue(batch);
+		}
+
+		/**
+		 * @brief Remove next request and the ones merging with it from the queue
+		 */
+		std::vector<request_t *> next()
+		{
+			std::sort(m_pending.begin(), m_pending.end(), [](const request_t *a, const request_t *b) { return a->lba < b->lba; });
+
+			auto oldest = std::min_element(m_pending.begin(), m_pending.end(), [](const request_t *a, const request_t *b) { return a->arrival < b->arrival; });
+			auto first = oldest;
+			if (std::chrono::steady_clock::now() - (*oldest)->arrival < m_deadline)
+			{
+				/* Elevator, wrap around at the end */
+				first = std::find_if(m_pending.begin(), m_pending.end(), [this](const request_t *request) { return request->lba >= m_head; });
+				if (first == m_pending.end())
+				{
+					first = m_pending.begin();
+				}
+			}
+
+			size_t start = (*first)->lba;
+			size_t end = start + (*first)->count;
+			auto last = first + 1;
+			while ((last != m_pending.end()) && ((*last)->lba <= end) && (std::max(end, (*last)->lba + (*last)->count) - start <= m_max_lba))
+			{
+				end = std::max(end, (*last)->lba + (*last)->count);
+				++last;
+			}
+			m_head = end;
+
+			std::vector<request_t *> batch(first, last);
+			m_pending.erase(first, last);
+			return batch;
+		}
+
+		/**
+		 * @brief Read batch as one transfer, requests not covered after an error are read alone
+		 *
+		 * Without a merge buffer, all requests of the batch are read alone.
+		 */
+		void issue(const std::vector<request_t *> &batch)
+		{
+			buffer_pool::buffer buffer;
+			if (batch.size() > 1)
+			{
+				buffer = m_buffers.try_allocate();
+			}
+			if (!buffer.data())
+			{
+				for (request_t *request: batch)
+				{
+					request->result = m_drive.read(request->lba, request->count, request->data);
+				}
+				return;
+			}
+
+			size_t start = batch.front()->lba;
+			size_t end = start;
+			for (const request_t *request: batch)
+			{
+				end = std::max(end, request->lba + request->count);
+			}
+
+			size_t result = m_drive.read(start, end - start, buffer.data());
+
+			for (request_t *request: batch)
+			{
+				size_t offset = (request->lba - start) * sector_size;
+				size_t length = request->count * sector_size;
+				if (offset + length <= result)
+				{
+					memcpy(request->data, buffer.data() + offset, length);
+					request->result = length;
+				}
+				else
+				{
+					request->result = m_drive.read(request->lba, request->count, request->data);
+				}
+			}
+		}
+};
+
+}
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <raidfuse/interface.hpp>
+#include <raidfuse/fingerprint.hpp>
+
+namespace raidfuse {
+
+/**
+ * @brief Probed state of an assembled array, kept across mounts
+ *
+ * File layout: one record (4 KiB) with geometry, fingerprints and the
+ * partition found by probing.
+ *
+ * A member fingerprint is the hash of the first 16 KiB of the member, it
+ * identifies the members and their order. The fingerprint of the assembled
+ * array covers the partition tables as seen through overlay and cache: the
+ * first two logical blocks with protective MBR and GPT header, plus the
+ * partition entry array the header points to. Without GPT it is the hash
+ * of the first 16 KiB as well. Checking them reads a few sectors per
+ * member, instead of probing the whole array. Any change there makes the
+ * snapshot stale and the array is probed again.
+ *
+ * The record is replaced atomically by renaming a temporary file.
+ */
+class snapshot
+{
+	public:
+		static constexpr size_t record_size = 4096;
+		static constexpr size_t max_members = 64;
+
+		struct __attribute__((packed)) record_t
+		{
+			std::uint8_t signature[16];
+			std::uint32_t version;
+			std::uint32_t count;
+			std::uint64_t stripe_size;
+			std::uint64_t member_size;
+			std::uint32_t logical_block;
+			std::uint32_t physical_block;
+			std::uint64_t array_fingerprint;
+			std::uint64_t member_fingerprint[max_members];
+			/* Fields above have to match the array */
+			std::uint64_t partition_start;
+			std::uint64_t partition_end;
+			std::uint8_t reserved[3512];
+
+			bool valid() const
+			{
+				return !memcmp(signature, "RAIDFUSE SNAP\0\0\0", sizeof(signature)) && (version == 1) && (count <= max_members);
+			}
+		};
+		static_assert(sizeof(record_t) == record_size, "Size of snapshot record mismatch!");
+
+		/**
+		 * @param filename snapshot file, created by save()
+		 * @param members member drives in array order
+		 * @param array assembled array, including overlay and cache
+		 * @param stripe chunk size in bytes
+		 */
+		snapshot(std::string filename, const std::vector<interface::drive *> &members, interface::drive &array, size_t stripe):
+			m_filename(filename)
+		{
+			if (members.empty() || (members.size() > max_members))
+			{
+				throw std::runtime_error("Snapshot '" + filename + "' supports 1 to 64 members");
+			}
+
+			memset(&m_record, 0, sizeof(m_record));
+			memcpy(m_record.signature, "RAIDFUSE SNAP\0\0\0", sizeof(m_record.signature));
+			m_record.version = 1;
+			m_record.count = members.size();
+			m_record.stripe_size = stripe;
+			m_record.member_size = members.front()->size();
+			m_record.logical_block = array.logical_block_size();
+			m_record.physical_block = array.physical_block_size();
+			m_record.array_fingerprint = fingerprint::tables(array);
+			for (size_t index = 0; index < members.size(); index++)
+			{
+				m_record.member_fingerprint[index] = fingerprint::member(*members[index]);
+			}
+		}
+
+		/**
+		 * @brief Load partition from snapshot file
+		 * @return false if file is missing or does not match the array
+		 */
+		bool load()
+		{
+			int fd = ::open(m_filename.c_str(), O_RDONLY);
+			if (fd < 0)
+			{
+				if (errno == ENOENT)
+				{
+					return false;
+				}
+				throw std::runtime_error("Error opening snapshot '" + m_filename + "'");
+			}
+
+			record_t record;
+			ssize_t result = ::pread(fd, &record, sizeof(record), 0);
+			::close(fd);
+
+			if ((result != sizeof(record)) || !record.valid())
+			{
+				/* Never overwrite a file which is not a snapshot */
+				throw std::runtime_error("Snapshot '" + m_filename + "' invalid");
+			}
+
+			if (memcmp(&record, &m_record, offsetof(record_t, partition_start)))
+			{
+				return false;
+			}
+
+			m_record.partition_start = record.partition_start;
+			m_record.partition_end = record.partition_end;
+			return true;
+		}
+
+		/**
+		 * @brief Write snapshot file, replacing the previous one
+		 */
+		void save()
+		{
+			std::string temporary = m_filename + ".tmp";
+			int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (fd < 0)
+			{
+				throw std::runtime_error("Error creating snapshot '" + temporary + "'");
+			}
+
+			bool success = (::pwrite(fd, &m_record, sizeof(m_record), 0) == sizeof(m_record)) && !::fsync(fd);
+			success = !::close(fd) && success;
+			if (!success || ::rename(temporary.c_str(), m_filename.c_str()))
+			{
+				::unlink(temporary.c_str());
+				throw std::runtime_error("Error writing snapshot '" + m_filename + "'");
+			}
+		}
+
+		/**
+		 * @brief Partition in sectors of the array, end inclusive
+		 * @return false if there is none
+		 */
+		bool partition(size_t &start, size_t &end) const
+		{
+			start = m_record.partition_start;
+			end = m_record.partition_end;
+			return end != 0;
+		}
+
+		void record_partition(size_t start, size_t end)
+		{
+			m_record.partition_start = start;
+			m_record.partition_end = end;
+		}
+
+	protected:
+		std::string m_filename;
+		record_t m_record;
+};
+
+}
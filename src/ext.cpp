@@ -0,0 +1,193 @@
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+#include <ext2fs/ext2fs.h>
+
+#include <raidfuse/ext.hpp>
+
+namespace {
+
+/**
+ * @brief Minimal read-only io_manager backed by an interface::drive
+ *
+ * libext2fs only knows file names, so the drive pointer is passed as name.
+ */
+errcode_t drive_open(const char *name, int flags, io_channel *channel);
+
+errcode_t drive_close(io_channel channel)
+{
+	if (--channel->refcount > 0)
+	{
+		return 0;
+	}
+
+	delete[] channel->name;
+	delete channel;
+	return 0;
+}
+
+errcode_t drive_set_blksize(io_channel channel, int blksize)
+{
+	channel->block_size = blksize;
+	return 0;
+}
+
+errcode_t drive_read_blk64(io_channel channel, unsigned long long block, int count, void *data)
+{
+	raidfuse::interface::drive *drive = (raidfuse::interface::drive *)channel->private_data;
+
+	size_t offset = block * channel->block_size;
+	size_t length = (count < 0) ? -count : (size_t)count * channel->block_size;
+
+	size_t lba = offset / raidfuse::interface::drive::sector_size;
+	size_t skip = offset % raidfuse::interface::drive::sector_size;
+	size_t sectors = (skip + length + raidfuse::interface::drive::sector_size - 1) / raidfuse::interface::drive::sector_size;
+
+	if ((skip == 0) && (length % raidfuse::interface::drive::sector_size == 0))
+	{
+		if (drive->read(lba, sectors, (std::uint8_t *)data) != length)
+		{
+			return EXT2_ET_SHORT_READ;
+		}
+		return 0;
+	}
+
+	std::vector<std::uint8_t> buffer(sectors * raidfuse::interface::drive::sector_size);
+	if (drive->read(lba, sectors, &buffer[0]) != buffer.size())
+	{
+		return EXT2_ET_SHORT_READ;
+	}
+	memcpy(data, &buffer[skip], length);
+	return 0;
+}
+
+errcode_t drive_read_blk(io_channel channel, unsigned long block, int count, void *data)
+{
+	return drive_read_blk64(channel, block, count, data);
+}
+
+errcode_t drive_write_blk(io_channel, unsigned long, int, const void *)
+{
+	return EXT2_ET_UNIMPLEMENTED;
+}
+
+errcode_t drive_write_blk64(io_channel, unsigned long long, int, const void *)
+{
+	return EXT2_ET_UNIMPLEMENTED;
+}
+
+errcode_t drive_flush(io_channel)
+{
+	return 0;
+}
+
+struct_io_manager drive_manager()
+{
+	struct_io_manager manager;
+	memset(&manager, 0, sizeof(manager));
+
+	manager.magic = EXT2_ET_MAGIC_IO_MANAGER;
+	manager.name = "raidfuse drive I/O manager";
+	manager.open = drive_open;
+	manager.close = drive_close;
+	manager.set_blksize = drive_set_blksize;
+	manager.read_blk = drive_read_blk;
+	manager.write_blk = drive_write_blk;
+	manager.flush = drive_flush;
+	manager.read_blk64 = drive_read_blk64;
+	manager.write_blk64 = drive_write_blk64;
+	return manager;
+}
+
+struct_io_manager manager = drive_manager();
+
+errcode_t drive_open(const char *name, int flags, io_channel *channel)
+{
+	void *drive;
+	if (sscanf(name, "%p", &drive) != 1)
+	{
+		return EXT2_ET_BAD_DEVICE_NAME;
+	}
+
+	io_channel result = new struct_io_channel();
+	result->magic = EXT2_ET_MAGIC_IO_CHANNEL;
+	result->manager = &manager;
+	result->name = new char[strlen(name) + 1];
+	strcpy(result->name, name);
+	result->block_size = 1024;
+	result->refcount = 1;
+	result->flags = flags;
+	result->private_data = drive;
+
+	*channel = result;
+	return 0;
+}
+
+}
+
+namespace raidfuse { namespace ext {
+
+std::vector<extent_t> allocated(interface::drive &drive, size_t gap)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "%p", (void *)&drive);
+
+	ext2_filsys fs;
+	if (ext2fs_open(name, EXT2_FLAG_64BITS, 0, 0, &manager, &fs))
+	{
+		throw std::runtime_error("ext: no filesystem found");
+	}
+
+	if (ext2fs_read_block_bitmap(fs))
+	{
+		ext2fs_close(fs);
+		throw std::runtime_error("ext: error reading block bitmaps");
+	}
+
+	size_t block_lba = fs->blocksize / interface::drive::sector_size;
+	size_t gap_lba = gap / interface::drive::sector_size;
+	blk64_t first = fs->super->s_first_data_block;
+	blk64_t last = ext2fs_blocks_count(fs->super) - 1;
+
+	std::vector<extent_t> result;
+
+	/* Boot block ahead of the first data block is not covered by the bitmap */
+	if (first)
+	{
+		result.push_back({ 0, first * block_lba });
+	}
+
+	blk64_t block = first;
+	while (block <= last)
+	{
+		blk64_t start, end;
+		if (ext2fs_find_first_set_block_bitmap2(fs->block_map, block, last, &start))
+		{
+			break;
+		}
+		if (ext2fs_find_first_zero_block_bitmap2(fs->block_map, start, last, &end))
+		{
+			end = last + 1;
+		}
+
+		size_t lba = start * block_lba;
+		size_t count = (end - start) * block_lba;
+		if (result.size() && (result.back().lba + result.back().count + gap_lba >= lba))
+		{
+			result.back().count = lba + count - result.back().lba;
+		}
+		else
+		{
+			result.push_back({ lba, count });
+		}
+		block = end;
+	}
+
+	ext2fs_close(fs);
+	return result;
+}
+
+} }
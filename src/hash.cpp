@@ -0,0 +1,273 @@
+#include <cstring>
+#include <algorithm>
+#include <sstream>
+#include <iomanip>
+
+#include <raidfuse/hash.hpp>
+
+namespace {
+
+inline std::uint32_t rotr32(std::uint32_t value, int count)
+{
+	return (value >> count) | (value << (32 - count));
+}
+
+inline std::uint64_t rotl64(std::uint64_t value, int count)
+{
+	return (value << count) | (value >> (64 - count));
+}
+
+inline std::uint32_t load_be32(const std::uint8_t *data)
+{
+	return ((std::uint32_t)data[0] << 24) | ((std::uint32_t)data[1] << 16) | ((std::uint32_t)data[2] << 8) | data[3];
+}
+
+inline std::uint64_t load_le64(const std::uint8_t *data)
+{
+	std::uint64_t value;
+	memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+inline std::uint32_t load_le32(const std::uint8_t *data)
+{
+	std::uint32_t value;
+	memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+const std::uint32_t sha256_k[64] =
+{
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+constexpr std::uint64_t xxh64_prime_1 = 0x9E3779B185EBCA87ULL;
+constexpr std::uint64_t xxh64_prime_2 = 0xC2B2AE3D27D4EB4FULL;
+constexpr std::uint64_t xxh64_prime_3 = 0x165667B19E3779F9ULL;
+constexpr std::uint64_t xxh64_prime_4 = 0x85EBCA77C2B2AE63ULL;
+constexpr std::uint64_t xxh64_prime_5 = 0x27D4EB2F165667C5ULL;
+
+inline std::uint64_t xxh64_round(std::uint64_t accumulator, std::uint64_t lane)
+{
+	accumulator += lane * xxh64_prime_2;
+	accumulator = rotl64(accumulator, 31);
+	return accumulator * xxh64_prime_1;
+}
+
+inline std::uint64_t xxh64_merge(std::uint64_t accumulator, std::uint64_t value)
+{
+	accumulator ^= xxh64_round(0, value);
+	return accumulator * xxh64_prime_1 + xxh64_prime_4;
+}
+
+}
+
+namespace raidfuse { namespace hash {
+
+sha256::sha256():
+	m_state{ 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 },
+	m_length(0),
+	m_fill(0)
+{
+
+}
+
+void sha256::transform(const std::uint8_t *block)
+{
+	std::uint32_t w[64];
+	for (int index = 0; index < 16; index++)
+	{
+		w[index] = load_be32(block + index * 4);
+	}
+	for (int index = 16; index < 64; index++)
+	{
+		std::uint32_t s0 = rotr32(w[index - 15], 7) ^ rotr32(w[index - 15], 18) ^ (w[index - 15] >> 3);
+		std::uint32_t s1 = rotr32(w[index - 2], 17) ^ rotr32(w[index - 2], 19) ^ (w[index - 2] >> 10);
+		w[index] = w[index - 16] + s0 + w[index - 7] + s1;
+	}
+
+	std::uint32_t a = m_state[0], b = m_state[1], c = m_state[2], d = m_state[3];
+	std::uint32_t e = m_state[4], f = m_state[5], g = m_state[6], h = m_state[7];
+
+	for (int index = 0; index < 64; index++)
+	{
+		std::uint32_t s1 = rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25);
+		std::uint32_t ch = (e & f) ^ (~e & g);
+		std::uint32_t t1 = h + s1 + ch + sha256_k[index] + w[index];
+		std::uint32_t s0 = rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22);
+		std::uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+		std::uint32_t t2 = s0 + maj;
+
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+
+	m_state[0] += a; m_state[1] += b; m_state[2] += c; m_state[3] += d;
+	m_state[4] += e; m_state[5] += f; m_state[6] += g; m_state[7] += h;
+}
+
+void sha256::update(const std::uint8_t *data, size_t size)
+{
+	m_length += size;
+
+	if (m_fill)
+	{
+		size_t length = std::min(size, sizeof(m_block) - m_fill);
+		memcpy(m_block + m_fill, data, length);
+		m_fill += length;
+		data += length;
+		size -= length;
+
+		if (m_fill < sizeof(m_block))
+		{
+			return;
+		}
+		transform(m_block);
+		m_fill = 0;
+	}
+
+	while (size >= sizeof(m_block))
+	{
+		transform(data);
+		data += sizeof(m_block);
+		size -= sizeof(m_block);
+	}
+
+	memcpy(m_block, data, size);
+	m_fill = size;
+}
+
+std::string sha256::digest()
+{
+	std::uint64_t bits = m_length * 8;
+	std::uint8_t padding[72] = { 0x80 };
+	size_t length = (m_fill < 56) ? (56 - m_fill) : (120 - m_fill);
+	for (int index = 0; index < 8; index++)
+	{
+		padding[length + index] = bits >> (56 - index * 8);
+	}
+	update(padding, length + 8);
+
+	std::ostringstream out;
+	out << std::hex << std::setfill('0');
+	for (std::uint32_t value: m_state)
+	{
+		out << std::setw(8) << value;
+	}
+	return out.str();
+}
+
+xxh64::xxh64(std::uint64_t seed):
+	m_seed(seed),
+	m_state{ seed + xxh64_prime_1 + xxh64_prime_2, seed + xxh64_prime_2, seed, seed - xxh64_prime_1 },
+	m_length(0),
+	m_fill(0)
+{
+
+}
+
+void xxh64::transform(const std::uint8_t *block)
+{
+	for (int index = 0; index < 4; index++)
+	{
+		m_state[index] = xxh64_round(m_state[index], load_le64(block + index * 8));
+	}
+}
+
+void xxh64::update(const std::uint8_t *data, size_t size)
+{
+	m_length += size;
+
+	if (m_fill)
+	{
+		size_t length = std::min(size, sizeof(m_block) - m_fill);
+		memcpy(m_block + m_fill, data, length);
+		m_fill += length;
+		data += length;
+		size -= length;
+
+		if (m_fill < sizeof(m_block))
+		{
+			return;
+		}
+		transform(m_block);
+		m_fill = 0;
+	}
+
+	while (size >= sizeof(m_block))
+	{
+		transform(data);
+		data += sizeof(m_block);
+		size -= sizeof(m_block);
+	}
+
+	memcpy(m_block, data, size);
+	m_fill = size;
+}
+
+std::string xxh64::digest()
+{
+	std::uint64_t result;
+	if (m_length >= sizeof(m_block))
+	{
+		result = rotl64(m_state[0], 1) + rotl64(m_state[1], 7) + rotl64(m_state[2], 12) + rotl64(m_state[3], 18);
+		for (std::uint64_t value: m_state)
+		{
+			result = xxh64_merge(result, value);
+		}
+	}
+	else
+	{
+		result = m_seed + xxh64_prime_5;
+	}
+	result += m_length;
+
+	const std::uint8_t *data = m_block;
+	size_t size = m_fill;
+	while (size >= 8)
+	{
+		result ^= xxh64_round(0, load_le64(data));
+		result = rotl64(result, 27) * xxh64_prime_1 + xxh64_prime_4;
+		data += 8;
+		size -= 8;
+	}
+	if (size >= 4)
+	{
+		result ^= (std::uint64_t)load_le32(data) * xxh64_prime_1;
+		result = rotl64(result, 23) * xxh64_prime_2 + xxh64_prime_3;
+		data += 4;
+		size -= 4;
+	}
+	while (size)
+	{
+		result ^= (*data) * xxh64_prime_5;
+		result = rotl64(result, 11) * xxh64_prime_1;
+		data++;
+		size--;
+	}
+
+	result ^= result >> 33;
+	result *= xxh64_prime_2;
+	result ^= result >> 29;
+	result *= xxh64_prime_3;
+	result ^= result >> 32;
+
+	std::ostringstream out;
+	out << std::hex << std::setfill('0') << std::setw(16) << result;
+	return out.str();
+}
+
+} }
@@ -18,6 +18,11 @@
 
 #include <cstdint>
 #include <cmath>
+#include <memory>
+#include <sstream>
+#include <fstream>
+
+#include <getopt.h>
 
 #include <ext2fs/ext2fs.h>
 
@@ -33,6 +38,15 @@
 #include <raidfuse/mbr.hpp>
 #include <raidfuse/gpt.hpp>
 #include <raidfuse/partition.hpp>
+#include <raidfuse/exporter.hpp>
+#include <raidfuse/hash.hpp>
+#include <raidfuse/ext.hpp>
+#include <raidfuse/overlay.hpp>
+#include <raidfuse/cache.hpp>
+#include <raidfuse/rebuild.hpp>
+#include <raidfuse/executor.hpp>
+#include <raidfuse/admission.hpp>
+#include <raidfuse/snapshot.hpp>
 
 std::ostream& operator<<(std::ostream& out, raidfuse::gpt::name_t name)
 {
@@ -48,36 +62,290 @@ std::ostream& operator<<(std::ostream& out, raidfuse::gpt::name_t name)
 
 static const char *raid_file = "/raid";
 static const char *partition_file = "/partition";
+static const char *stats_file = "/stats";
 
-raidfuse::raid5 raid(256 * 1024);
-raidfuse::partition *part;
+/**
+ * @brief Assembled array, its files are in a directory of its name or in the root directory if unnamed
+ */
+struct array_t
+{
+	std::string name;
+	size_t index;
+	std::vector<std::string> members;
+	std::vector< std::unique_ptr<raidfuse::drive> > drives;
+	std::unique_ptr<raidfuse::raid5> raid;
+	std::unique_ptr<raidfuse::cache> ssd;
+	std::unique_ptr<raidfuse::overlay> cow;
+	std::unique_ptr<raidfuse::partition> part;
+	raidfuse::interface::drive *disk;
+
+	/* Partition is probed on first access, then saved to the snapshot if given */
+	std::once_flag probed;
+	std::unique_ptr<raidfuse::snapshot> snapshot;
+};
+
+void probed(array_t &array);
+
+/* Declared before the arrays, whose pools and queues refer to them until destroyed */
+raidfuse::budget memory;
+std::unique_ptr<raidfuse::executor> workers;
+raidfuse::admission fairness;
+std::vector< std::unique_ptr<array_t> > arrays;
+
+struct mount_options
+{
+	char *config;
+	char *snapshot;
+	unsigned long threads;
+	unsigned long memory;
+	int writable;
+	char *journal;
+	char *overlay;
+	char *cache;
+	unsigned long cache_size;
+	unsigned long queue_depth;
+	unsigned long queue_deadline;
+	unsigned long hedge;
+	double hedge_percentile;
+	char *badblocks;
+	int verify;
+	int hugepages;
+	unsigned long retries;
+	unsigned long retry_size;
+};
+
+mount_options options;
+
+const fuse_opt option_spec[] =
+{
+	{ "--config=%s", offsetof(mount_options, config), 0 },
+	{ "--snapshot=%s", offsetof(mount_options, snapshot), 0 },
+	{ "--threads=%lu", offsetof(mount_options, threads), 0 },
+	{ "--memory=%lu", offsetof(mount_options, memory), 0 },
+	{ "--writable", offsetof(mount_options, writable), 1 },
+	{ "--journal=%s", offsetof(mount_options, journal), 0 },
+	{ "--overlay=%s", offsetof(mount_options, overlay), 0 },
+	{ "--cache=%s", offsetof(mount_options, cache), 0 },
+	{ "--cache-size=%lu", offsetof(mount_options, cache_size), 0 },
+	{ "--queue-depth=%lu", offsetof(mount_options, queue_depth), 0 },
+	{ "--queue-deadline=%lu", offsetof(mount_options, queue_deadline), 0 },
+	{ "--hedge=%lu", offsetof(mount_options, hedge), 0 },
+	{ "--hedge-percentile=%lf", offsetof(mount_options, hedge_percentile), 0 },
+	{ "--badblocks=%s", offsetof(mount_options, badblocks), 0 },
+	{ "--verify", offsetof(mount_options, verify), 1 },
+	{ "--hugepages", offsetof(mount_options, hugepages), 1 },
+	{ "--retries=%lu", offsetof(mount_options, retries), 0 },
+	{ "--retry-size=%lu", offsetof(mount_options, retry_size), 0 },
+	FUSE_OPT_END
+};
 //std::vector<raidfuse::partition *> paritions;
 
+/**
+ * @brief Counters of one array as text
+ */
+void array_stats(std::ostream &out, array_t &array)
+{
+	raidfuse::raid5 &raid = *array.raid;
+
+	out << "mapping: " << (raid.specialized() ? "specialized" : "generic") << std::endl;
+
+	for (size_t member = 0; member < raid.count(); member++)
+	{
+		const raidfuse::latency &latency = raid.member_latency(member);
+		out << "member " << member << ": reads " << latency.count()
+			<< ", mean " << std::chrono::duration_cast<std::chrono::microseconds>(latency.mean()).count() << " us"
+			<< ", p50 " << std::chrono::duration_cast<std::chrono::microseconds>(latency.percentile(50)).count() << " us"
+			<< ", p99 " << std::chrono::duration_cast<std::chrono::microseconds>(latency.percentile(99)).count() << " us";
+		if (raidfuse::scheduler *queue = raid.member_scheduler(member))
+		{
+			out << ", queued " << queue->requests() << ", transfers " << queue->transfers();
+		}
+		out << std::endl;
+	}
+
+	out << "hedged: " << raid.hedged() << std::endl;
+	out << "hedged reconstructed: " << raid.reconstructed() << std::endl;
+	out << "recovered sectors: " << raid.recovered() << std::endl;
+	out << "bad ranges: " << raid.badblocks().count() << std::endl;
+
+	raidfuse::buffer_pool::stats_t pool = raid.buffers().stats();
+	out << "buffer allocations: " << pool.allocations << ", transient " << pool.transient << std::endl;
+	out << "buffers in use: " << pool.in_use << ", high water " << pool.high_water << std::endl;
+	out << "buffer memory: " << pool.bytes << " Bytes in " << pool.slabs << " slabs, " << pool.huge_bytes << " Bytes huge pages" << std::endl;
+
+	if (array.ssd)
+	{
+		raidfuse::cache::stats_t cache = array.ssd->stats();
+		size_t reads = cache.hits + cache.misses;
+		out << "cache: hits " << cache.hits << ", misses " << cache.misses
+			<< ", hit rate " << (reads ? 100 * cache.hits / reads : 0) << " %"
+			<< ", used " << cache.used << " / " << cache.slots << " blocks" << std::endl;
+	}
+
+	if (options.verify)
+	{
+		out << "verified rows: " << raid.verified_rows() << std::endl;
+		out << "unverified rows: " << raid.unverified_rows() << std::endl;
+		out << "mismatching rows: " << raid.mismatches();
+		for (size_t row: raid.mismatch_rows())
+		{
+			out << " " << row;
+		}
+		out << std::endl;
+	}
+}
+
+/**
+ * @brief Counters of all arrays as text
+ */
+std::string stats()
+{
+	std::ostringstream out;
+
+	for (std::unique_ptr<array_t> &array: arrays)
+	{
+		if (!array->name.empty())
+		{
+			out << "[" << array->name << "]" << std::endl;
+		}
+		array_stats(out, *array);
+	}
+
+	if (memory.limit())
+	{
+		out << "memory: " << memory.used() << " / " << memory.limit() << " Bytes" << std::endl;
+	}
+	return out.str();
+}
+
+enum class node_t
+{
+	none,
+	root,
+	directory,
+	raid,
+	partition,
+	stats
+};
+
+/**
+ * @brief Resolve path, files of an unnamed array are in the root directory
+ */
+node_t resolve(const char *path, array_t *&array)
+{
+	array = nullptr;
+
+	if (strcmp(path, "/") == 0)
+	{
+		return node_t::root;
+	}
+
+	if (strcmp(path, stats_file) == 0)
+	{
+		return node_t::stats;
+	}
+
+	for (std::unique_ptr<array_t> &item: arrays)
+	{
+		std::string directory = item->name.empty() ? "" : "/" + item->name;
+		array = item.get();
+
+		if (!item->name.empty() && (directory == path))
+		{
+			return node_t::directory;
+		}
+
+		if (directory + raid_file == path)
+		{
+			return node_t::raid;
+		}
+
+		if (directory + partition_file == path)
+		{
+			probed(*item);
+			if (item->part)
+			{
+				return node_t::partition;
+			}
+		}
+	}
+
+	array = nullptr;
+	return node_t::none;
+}
+
+/**
+ * @brief Drive behind raid or partition file
+ */
+raidfuse::interface::drive *resolve_drive(const char *path, array_t *&array)
+{
+	switch (resolve(path, array))
+	{
+		case node_t::raid: return array->disk;
+		case node_t::partition: return array->part.get();
+		default: return nullptr;
+	}
+}
+
+/**
+ * @brief Error code of the exception being handled, none may unwind through libfuse
+ */
+int failure()
+{
+	try
+	{
+		throw;
+	}
+	catch (const std::bad_alloc &)
+	{
+		return -ENOMEM;
+	}
+	catch (const std::exception &error)
+	{
+		std::cerr << error.what() << std::endl;
+		return -EIO;
+	}
+	catch (...)
+	{
+		return -EIO;
+	}
+}
+
 int raid_getattr(const char *path, struct stat *stbuf)
 {
 	int res = 0;
 
 	memset(stbuf, 0, sizeof(struct stat));
-	if (strcmp(path, "/") == 0)
+
+	array_t *array;
+	node_t node = resolve(path, array);
+	if ((node == node_t::root) || (node == node_t::directory))
 	{
 		stbuf->st_mode = S_IFDIR | 0755;
 		stbuf->st_nlink = 2;
 	}
 	else
-	if (strcmp(path, raid_file) == 0)
+	if ((node == node_t::raid) || (node == node_t::partition))
 	{
-		stbuf->st_mode = S_IFREG | 0444;
+		stbuf->st_mode = S_IFREG | ((options.writable || options.overlay) ? 0644 : 0444);
 		stbuf->st_nlink = 1;
-		stbuf->st_size = raid.size();
+		stbuf->st_size = resolve_drive(path, array)->size();
+		stbuf->st_blksize = resolve_drive(path, array)->physical_block_size();
 		stbuf->st_atime = 0;
 	}
 	else
-	if (strcmp(path, partition_file) == 0)
+	if (node == node_t::stats)
 	{
 		stbuf->st_mode = S_IFREG | 0444;
 		stbuf->st_nlink = 1;
-		stbuf->st_size = part->size();
-		stbuf->st_atime = 0;
+		try
+		{
+			stbuf->st_size = stats().size();
+		}
+		catch (...)
+		{
+			return failure();
+		}
 	}
 	else
 		res = -ENOENT;
@@ -90,15 +358,38 @@ int raid_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offs
 	(void) offset;
 	(void) fi;
 
-	if (strcmp(path, "/") != 0)
+	array_t *array;
+	node_t node = resolve(path, array);
+	if ((node != node_t::root) && (node != node_t::directory))
 	{
 		return -ENOENT;
 	}
 
 	filler(buf, ".", NULL, 0);
 	filler(buf, "..", NULL, 0);
-	filler(buf, raid_file + 1, NULL, 0);
-	filler(buf, partition_file + 1, NULL, 0);
+
+	for (std::unique_ptr<array_t> &item: arrays)
+	{
+		if ((node == node_t::root) && !item->name.empty())
+		{
+			filler(buf, item->name.c_str(), NULL, 0);
+		}
+		else
+		if ((node == node_t::directory) ? (item.get() == array) : item->name.empty())
+		{
+			filler(buf, raid_file + 1, NULL, 0);
+			probed(*item);
+			if (item->part)
+			{
+				filler(buf, partition_file + 1, NULL, 0);
+			}
+		}
+	}
+
+	if (node == node_t::root)
+	{
+		filler(buf, stats_file + 1, NULL, 0);
+	}
 
 /*
 	for (std::string &entry: entries)
@@ -112,152 +403,734 @@ int raid_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offs
 
 int raid_open(const char *path, struct fuse_file_info *fi)
 {
-	if ((strcmp(path, raid_file) != 0) && (strcmp(path, partition_file) != 0))
+	array_t *array;
+	node_t node = resolve(path, array);
+	if (node == node_t::stats)
+	{
+		/* Content changes with every read, bypass page cache */
+		fi->direct_io = 1;
+		return ((fi->flags & 3) == O_RDONLY) ? 0 : -EACCES;
+	}
+
+	if ((node != node_t::raid) && (node != node_t::partition))
 	{
 		return -ENOENT;
 	}
 
-	if ((fi->flags & 3) != O_RDONLY)
+	if (((fi->flags & 3) != O_RDONLY) && !options.writable && !options.overlay)
 	{
 		return -EACCES;
 	}
 	return 0;
 }
 
-int raid_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+int raid_truncate(const char *path, off_t size)
 {
-	constexpr size_t sector_size = 512;
+	array_t *array;
+	raidfuse::interface::drive *drive = resolve_drive(path, array);
+	if (!drive)
+	{
+		return -ENOENT;
+	}
+	return ((size_t)size == drive->size()) ? 0 : -EPERM;
+}
 
-	size_t len;
-	(void) fi;
+/**
+ * @brief Read byte range, partial physical blocks at both ends are bounced through a buffer of the array
+ */
+int read_range(array_t &array, raidfuse::interface::drive &drive, char *buf, size_t size, off_t offset)
+{
+	constexpr size_t sector_size = raidfuse::interface::drive::sector_size;
 
-	if (strcmp(path, raid_file) == 0)
+//	std::clog << "read: offset = " << offset << ", size = " << size << std::endl;
+
+	if (offset >= drive.size())
 	{
-	//	std::clog << "read: offset = " << offset << ", size = " << size << std::endl;
+		std::cerr << "End of disk!" << std::endl;
+		return 0;
+	}
 
-		if (offset >= raid.size())
+	if (offset + size > drive.size())
+	{
+		std::clog << "read: size = " << drive.size() << ", offset = " << offset << ", size = " << size << std::endl;
+		size = drive.size() - offset;
+		std::clog << "Resize to size = " << size << std::endl;
+	}
+
+	size_t unit = drive.physical_block_size();
+	size_t start = offset / unit * unit;
+	size_t end = std::min((offset + size + unit - 1) / unit * unit, drive.size());
+
+	raidfuse::admission::ticket ticket(fairness, array.index);
+	if ((start == (size_t)offset) && (end == offset + size))
+	{
+		return (drive.read(start / sector_size, size / sector_size, (std::uint8_t *)buf) == size) ? size : -EIO;
+	}
+
+	/* Partial first and last block, the blocks between go to buf directly unless all fits into the bounce buffer */
+	size_t head = (start != (size_t)offset) ? std::min(start + unit, end) : start;
+	size_t tail = (end != offset + size) ? std::max((end - 1) / unit * unit, head) : end;
+
+	raidfuse::buffer_pool::buffer bounce = array.raid->buffers().try_allocate();
+	if (!bounce.data())
+	{
+		return -ENOMEM;
+	}
+	if (end - start <= bounce.size())
+	{
+		if (drive.read(start / sector_size, (end - start) / sector_size, bounce.data()) != end - start)
 		{
-			std::cerr << "End of disk!" << std::endl;
-			return 0;
+			return -EIO;
 		}
+		memcpy(buf, bounce.data() + (offset - start), size);
+		return size;
+	}
 
-		if (offset + size > raid.size())
+	if (head > start)
+	{
+		if (drive.read(start / sector_size, (head - start) / sector_size, bounce.data()) != head - start)
 		{
-			std::clog << "read: raid = " << raid.size() << ", offset = " << offset << ", size = " << size << std::endl;
-			size = raid.size() - offset;
-			std::clog << "Resize to size = " << size << std::endl;
+			return -EIO;
 		}
+		memcpy(buf, bounce.data() + (offset - start), std::min(head, offset + size) - offset);
+	}
 
-		size_t test_offset = offset % sector_size;
-		size_t test_size = size % sector_size;
+	if ((tail > head) && (drive.read(head / sector_size, (tail - head) / sector_size, (std::uint8_t *)buf + (head - offset)) != tail - head))
+	{
+		return -EIO;
+	}
 
-		if ((test_offset) || (test_size))
+	if (end > tail)
+	{
+		if (drive.read(tail / sector_size, (end - tail) / sector_size, bounce.data()) != end - tail)
 		{
-			std::cerr << "Out of bound!" << std::endl;
-			return 0;
+			return -EIO;
 		}
+		memcpy(buf + (tail - offset), bounce.data(), offset + size - tail);
+	}
+	return size;
+}
 
-		size_t lba_offset = offset / sector_size;
-		size_t lba_size = size / sector_size;
+int raid_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	(void) fi;
 
-		while (lba_size)
+	try
+	{
+		array_t *array;
+		if (raidfuse::interface::drive *drive = resolve_drive(path, array))
 		{
-		//	std::clog << "      lba = " << lba_offset << std::endl;
-			raid.read(lba_offset, (std::uint8_t *)buf);
+			return read_range(*array, *drive, buf, size, offset);
+		}
+		else
+		if (strcmp(path, stats_file) == 0)
+		{
+			std::string content = stats();
+			if ((size_t)offset >= content.size())
+			{
+				return 0;
+			}
+
+			size = std::min(size, content.size() - offset);
+			memcpy(buf, content.data() + offset, size);
+		}
+		else
+		{
+			return -ENOENT;
+		}
+	}
+	catch (...)
+	{
+		return failure();
+	}
+
+	return size;
+}
+
+/**
+ * @brief Write byte range, partial physical blocks at both ends are merged with current content
+ */
+int write_range(array_t &array, raidfuse::interface::drive &drive, const char *buf, size_t size, off_t offset)
+{
+	constexpr size_t sector_size = raidfuse::interface::drive::sector_size;
+
+	if ((size_t)offset >= drive.size())
+	{
+		return -ENOSPC;
+	}
+	size = std::min(size, drive.size() - offset);
+
+	size_t unit = drive.physical_block_size();
+	size_t start = offset / unit * unit;
+	size_t end = std::min((offset + size + unit - 1) / unit * unit, drive.size());
+
+	if ((start == (size_t)offset) && (end == offset + size))
+	{
+		return (drive.write(start / sector_size, size / sector_size, (const std::uint8_t *)buf) == size) ? size : -EIO;
+	}
 
-			buf += sector_size;
-			lba_offset++;
-			lba_size--;
+	/* Partial first and last block, the last one may be shorter at the end of the drive */
+	size_t head = (start != (size_t)offset) ? std::min(start + unit, end) : start;
+	size_t tail = (end != offset + size) ? std::max((end - 1) / unit * unit, head) : end;
+
+	raidfuse::buffer_pool::buffer bounce = array.raid->buffers().try_allocate();
+	if (!bounce.data())
+	{
+		return -ENOMEM;
+	}
+	if (end - start <= bounce.size())
+	{
+		/* Merged into one write */
+		if (((head > start) && (drive.read(start / sector_size, (head - start) / sector_size, bounce.data()) != head - start)) ||
+			((end > tail) && (drive.read(tail / sector_size, (end - tail) / sector_size, bounce.data() + (tail - start)) != end - tail)))
+		{
+			return -EIO;
 		}
+		memcpy(bounce.data() + (offset - start), buf, size);
+		return (drive.write(start / sector_size, (end - start) / sector_size, bounce.data()) == end - start) ? size : -EIO;
+	}
 
+	if (head > start)
+	{
+		if (drive.read(start / sector_size, (head - start) / sector_size, bounce.data()) != head - start)
+		{
+			return -EIO;
+		}
+		memcpy(bounce.data() + (offset - start), buf, std::min(head, offset + size) - offset);
+		if (drive.write(start / sector_size, (head - start) / sector_size, bounce.data()) != head - start)
+		{
+			return -EIO;
+		}
 	}
-	else
-	if (strcmp(path, partition_file) == 0)
+
+	if ((tail > head) && (drive.write(head / sector_size, (tail - head) / sector_size, (const std::uint8_t *)buf + (head - offset)) != tail - head))
 	{
-	//	std::clog << "read: offset = " << offset << ", size = " << size << std::endl;
+		return -EIO;
+	}
 
-		if (offset >= part->size())
+	if (end > tail)
+	{
+		if (drive.read(tail / sector_size, (end - tail) / sector_size, bounce.data()) != end - tail)
 		{
-			std::cerr << "End of partition!" << std::endl;
-			return 0;
+			return -EIO;
 		}
+		memcpy(bounce.data(), buf + (tail - offset), offset + size - tail);
+		if (drive.write(tail / sector_size, (end - tail) / sector_size, bounce.data()) != end - tail)
+		{
+			return -EIO;
+		}
+	}
+	return size;
+}
+
+int raid_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	(void) fi;
 
-		if (offset + size > part->size())
+	try
+	{
+		array_t *array;
+		if (raidfuse::interface::drive *drive = resolve_drive(path, array))
 		{
-			std::clog << "read: partition = " << part->size() << ", offset = " << offset << ", size = " << size << std::endl;
-			size = part->size() - offset;
-			std::clog << "Resize to size = " << size << std::endl;
+			return write_range(*array, *drive, buf, size, offset);
 		}
+	}
+	catch (...)
+	{
+		return failure();
+	}
+	return -ENOENT;
+}
+
+/**
+ * @brief Buffered stripe rows reach the members only here or when the buffer is full
+ */
+int raid_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	(void) datasync;
+	(void) fi;
 
-		size_t test_offset = offset % sector_size;
-		size_t test_size = size % sector_size;
+	array_t *array;
+	if (!resolve_drive(path, array))
+	{
+		return -ENOENT;
+	}
 
-		if ((test_offset) || (test_size))
+	try
+	{
+		return array->disk->flush() ? 0 : -EIO;
+	}
+	catch (...)
+	{
+		return failure();
+	}
+}
+
+/**
+ * @brief Threads are started here, fuse_main() may have forked into background
+ *
+ * All arrays share one worker pool, each with its own queue.
+ */
+void *raid_init(struct fuse_conn_info *conn)
+{
+	(void) conn;
+
+	size_t members = 0;
+	for (std::unique_ptr<array_t> &array: arrays)
+	{
+		members += array->raid->count();
+	}
+
+	workers.reset(new raidfuse::executor(options.threads ? options.threads : 2 * members));
+	for (std::unique_ptr<array_t> &array: arrays)
+	{
+		array->raid->workers(*workers, array->index);
+		if (options.hedge)
 		{
-			std::cerr << "Out of bound!" << std::endl;
-			return 0;
+			array->raid->hedge(*workers, std::chrono::microseconds(options.hedge), options.hedge_percentile, array->index);
 		}
+	}
+	return NULL;
+}
 
-		size_t lba_offset = offset / sector_size;
-		size_t lba_size = size / sector_size;
+void raid_destroy(void *private_data)
+{
+	(void) private_data;
 
-		while (lba_size)
+	for (std::unique_ptr<array_t> &array: arrays)
+	{
+		if (!array->disk->flush())
 		{
-		//	std::clog << "      lba = " << lba_offset << std::endl;
-			part->read(lba_offset, (std::uint8_t *)buf);
+			std::cerr << "Flush on unmount failed!" << std::endl;
+		}
 
-			buf += sector_size;
-			lba_offset++;
-			lba_size--;
+		/* Overlay does not pass flush on */
+		if (array->ssd && (array->disk != array->ssd.get()) && !array->ssd->flush())
+		{
+			std::cerr << "Cache flush on unmount failed!" << std::endl;
 		}
 	}
-	else
+
+	/* Let hedged reads still in flight finish while the arrays exist */
+	workers.reset();
+}
+
+struct export_options
+{
+	std::string command;
+	bool active = false;
+	bool rebuild = false;
+	size_t member = (size_t)-1;
+	bool partition = false;
+	bool sparse = false;
+	bool resume = false;
+	bool allocated = false;
+	std::string hash;
+	size_t offset = 0;
+	size_t block_size = 4 * 1024 * 1024;
+	size_t depth = 8;
+	size_t threads = 4;
+	std::string output;
+	int fd = -1;
+};
+
+/**
+ * @brief Parse "export [options] <output|->" or "rebuild --member=N [options] <output|->"
+ *
+ * Writing to stdout moves the informational output of the assembly to stderr.
+ * An output file is opened later by export_open().
+ */
+void export_parse(int argc, char **argv, export_options &options)
+{
+	static const option long_options[] =
 	{
-		return -ENOENT;
+		{ "partition", no_argument, nullptr, 'p' },
+		{ "sparse", no_argument, nullptr, 's' },
+		{ "hash", required_argument, nullptr, 'H' },
+		{ "offset", required_argument, nullptr, 'o' },
+		{ "resume", no_argument, nullptr, 'r' },
+		{ "allocated", no_argument, nullptr, 'a' },
+		{ "block-size", required_argument, nullptr, 'b' },
+		{ "depth", required_argument, nullptr, 'd' },
+		{ "threads", required_argument, nullptr, 't' },
+		{ "member", required_argument, nullptr, 'm' },
+		{ nullptr, 0, nullptr, 0 }
+	};
+
+	options.command = argv[0];
+	options.active = true;
+	options.rebuild = (options.command == "rebuild");
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "psH:o:rab:d:t:m:", long_options, nullptr)) != -1)
+	{
+		switch (opt)
+		{
+			case 'p': options.partition = true; break;
+			case 's': options.sparse = true; break;
+			case 'H': options.hash = optarg; break;
+			case 'o': options.offset = std::stoull(optarg); break;
+			case 'r': options.resume = true; break;
+			case 'a': options.allocated = true; options.partition = true; options.sparse = true; break;
+			case 'b': options.block_size = std::stoull(optarg); break;
+			case 'd': options.depth = std::stoull(optarg); break;
+			case 't': options.threads = std::stoull(optarg); break;
+			case 'm': options.member = std::stoull(optarg); break;
+			default:
+				if (options.rebuild)
+				{
+					throw std::runtime_error("usage: raidfuse rebuild --member=N [--sparse] [--hash=sha256|xxh64] [--offset=BYTES|--resume] [--block-size=BYTES] [--depth=N] [--threads=N] <output|->");
+				}
+				throw std::runtime_error("usage: raidfuse export [--partition] [--sparse] [--hash=sha256|xxh64] [--offset=BYTES|--resume] [--allocated] [--block-size=BYTES] [--depth=N] [--threads=N] <output|->");
+		}
+	}
+
+	if (optind + 1 != argc)
+	{
+		throw std::runtime_error(options.command + ": missing output");
 	}
+	options.output = argv[optind];
 
+	if ((options.hash != "") && (options.hash != "sha256") && (options.hash != "xxh64"))
+	{
+		throw std::runtime_error(options.command + ": unknown hash '" + options.hash + "'");
+	}
+
+	if (options.rebuild && (options.member == (size_t)-1))
+	{
+		throw std::runtime_error("rebuild: missing --member");
+	}
 
+	if (options.rebuild && options.partition)
+	{
+		throw std::runtime_error("rebuild: --partition and --allocated apply to export only");
+	}
 
-/*
-	len = strlen(hello_str);
-	if (offset < len)
+	if (options.hash.size() && (options.resume || options.offset))
+	{
+		throw std::runtime_error(options.command + ": --hash covers the whole output, it can not be combined with --offset or --resume");
+	}
+
+	if (options.output == "-")
+	{
+		if (options.resume)
+		{
+			throw std::runtime_error(options.command + ": --resume needs an output file");
+		}
+		options.fd = dup(STDOUT_FILENO);
+		dup2(STDERR_FILENO, STDOUT_FILENO);
+	}
+}
+
+/**
+ * @brief Open output, refuse to write to a member
+ *
+ * The output is truncated only after it is known not to be one of the
+ * members, and never with --resume or --offset.
+ *
+ * @param members device names the output must not be
+ */
+void export_open(export_options &options, const std::vector<std::string> &members)
+{
+	if (options.fd < 0)
+	{
+		options.fd = open(options.output.c_str(), O_WRONLY | O_CREAT, 0644);
+		if (options.fd < 0)
+		{
+			throw std::runtime_error("Error opening file '" + options.output + "'");
+		}
+	}
+
+	struct stat output;
+	if (fstat(options.fd, &output))
+	{
+		throw std::runtime_error("Error accessing output");
+	}
+
+	for (const std::string &name: members)
 	{
-		if (offset + size > len)
+		struct stat member;
+		if (!stat(name.c_str(), &member) &&
+			(S_ISBLK(member.st_mode) ? (S_ISBLK(output.st_mode) && (member.st_rdev == output.st_rdev)) : ((member.st_dev == output.st_dev) && (member.st_ino == output.st_ino))))
 		{
-			size = len - offset;
+			throw std::runtime_error(options.command + ": output is member '" + name + "'");
 		}
-		memcpy(buf, hello_str + offset, size);
+	}
+
+	if (options.output == "-")
+	{
+		return;
+	}
+
+	if (options.resume)
+	{
+		if (!S_ISREG(output.st_mode))
+		{
+			throw std::runtime_error(options.command + ": --resume needs a regular output file");
+		}
+		options.offset = output.st_size - (output.st_size % options.block_size);
+	}
+	else if (!options.offset && S_ISREG(output.st_mode) && ftruncate(options.fd, 0))
+	{
+		/* Skipped zero ranges have to read back as zero, so start from an empty file */
+		throw std::runtime_error("Error truncating file '" + options.output + "'");
+	}
+}
+
+int export_run(raidfuse::interface::drive &source, export_options &options)
+{
+	std::unique_ptr<raidfuse::interface::hash> hash;
+	if (options.hash == "sha256")
+	{
+		hash.reset(new raidfuse::hash::sha256());
 	}
 	else
-		size = 0;
-*/
+	if (options.hash == "xxh64")
+	{
+		hash.reset(new raidfuse::hash::xxh64());
+	}
 
-	return size;
+	raidfuse::exporter exporter(source, options.fd, options.block_size, options.depth, options.threads);
+	exporter.sparse(options.sparse);
+	exporter.hash(hash.get());
+	exporter.offset(options.offset);
+	if (options.allocated)
+	{
+		std::vector<raidfuse::extent_t> extents = raidfuse::ext::allocated(source);
+
+		size_t count = 0;
+		for (const raidfuse::extent_t &extent: extents)
+		{
+			count += extent.count;
+		}
+		std::clog << options.command << ": " << extents.size() << " extents, " << (count * raidfuse::interface::drive::sector_size) << " Bytes allocated" << std::endl;
+		exporter.extents(extents);
+	}
+	exporter.progress([&options](const raidfuse::exporter::status_t &status)
+	{
+		std::clog << options.command << ": offset " << (options.offset + status.done) << ", " << (status.done * 100 / std::max(status.total, (size_t)1)) << "%, " << (size_t)(status.rate / (1024 * 1024)) << " MiB/s" << std::endl;
+	});
+
+	raidfuse::exporter::status_t status = exporter.run();
+	if (close(options.fd))
+	{
+		throw std::runtime_error("Error closing output");
+	}
+
+	std::clog << options.command << ": " << status.done << " Bytes, " << status.skipped << " Bytes sparse" << std::endl;
+	if (hash)
+	{
+		std::clog << options.hash << ": " << hash->digest() << std::endl;
+	}
+	return EXIT_SUCCESS;
 }
 
-fuse_operations fuse_callback;
+/**
+ * @brief Stream content of a missing member, computed from the others
+ * @param members device names of all members, the missing one is not opened
+ */
+int rebuild_run(const std::vector<std::string> &members, export_options &options)
+{
+	if (options.member >= members.size())
+	{
+		throw std::runtime_error("rebuild: member out of range");
+	}
 
-int main(int argc, char** argv)
+	/* Do not overwrite a surviving member */
+	std::vector<std::string> names(members);
+	names.erase(names.begin() + options.member);
+	export_open(options, names);
+
+	std::vector< std::unique_ptr<raidfuse::drive> > drives;
+	std::vector<raidfuse::interface::drive *> survivors;
+	for (size_t index = 0; index < members.size(); index++)
+	{
+		if (index == options.member)
+		{
+			continue;
+		}
+
+		drives.push_back(std::unique_ptr<raidfuse::drive>(new raidfuse::drive(members[index])));
+		survivors.push_back(drives.back().get());
+	}
+
+	raidfuse::rebuild source(survivors, options.block_size, options.depth);
+	std::clog << "rebuild: member " << options.member << " (" << members[options.member] << ") from " << survivors.size() << " members, " << source.size() << " Bytes" << std::endl;
+	return export_run(source, options);
+}
+
+/**
+ * @brief Array of the configuration file
+ */
+struct array_config_t
 {
-#ifdef RAID
-	raidfuse::drive hdd0("/dev/sda");
-	raidfuse::drive hdd1("/dev/sdb");
-	raidfuse::drive hdd2("/dev/sdc");
-	raidfuse::drive hdd3("/dev/sdd");
+	std::string name;
+	size_t stripe;
+	std::vector<std::string> members;
+};
+
+/**
+ * @brief Read configuration, one "name chunk_size member..." line per array, '#' starts a comment
+ */
+std::vector<array_config_t> read_config(const std::string &filename)
+{
+	std::ifstream file(filename);
+	if (!file)
+	{
+		throw std::runtime_error("Error opening configuration '" + filename + "'");
+	}
+
+	std::vector<array_config_t> result;
+	std::string line;
+	while (std::getline(file, line))
+	{
+		line = line.substr(0, line.find('#'));
+
+		std::istringstream fields(line);
+		array_config_t config;
+		if (!(fields >> config.name))
+		{
+			continue;
+		}
+
+		std::string member;
+		if (!(fields >> config.stripe) || !config.stripe || (config.stripe % raidfuse::interface::drive::sector_size))
+		{
+			throw std::runtime_error("Invalid chunk size of array '" + config.name + "'");
+		}
+		while (fields >> member)
+		{
+			config.members.push_back(member);
+		}
+
+		if ((config.name.find('/') != std::string::npos) || (("/" + config.name) == stats_file) || (config.name == ".") || (config.name == ".."))
+		{
+			throw std::runtime_error("Invalid array name '" + config.name + "'");
+		}
+
+		for (const array_config_t &item: result)
+		{
+			if (item.name == config.name)
+			{
+				throw std::runtime_error("Duplicate array name '" + config.name + "'");
+			}
+		}
+
+		if (config.members.size() < 3)
+		{
+			throw std::runtime_error("Array '" + config.name + "' needs at least three members");
+		}
+		result.push_back(config);
+	}
 
-	std::cout << "hdd0 size: " << hdd0.size() << std::endl;
+	if (result.empty())
+	{
+		throw std::runtime_error("No array in configuration '" + filename + "'");
+	}
+	return result;
+}
 
-//	raidfuse::raid5 raid(32 * 1024);
-	raid.add(hdd0);
-	raid.add(hdd1);
-	raid.add(hdd2);
-	raid.add(hdd3);
+/**
+ * @brief File name option of an array, named arrays append their name
+ */
+std::string array_file(const char *option, const array_t &array)
+{
+	return array.name.empty() ? option : std::string(option) + "." + array.name;
+}
+
+/**
+ * @brief Open members and set up the array with its layers
+ */
+void assemble(array_t &array, const std::vector<std::string> &members, size_t stripe)
+{
+	array.raid.reset(new raidfuse::raid5(stripe));
+	array.members = members;
+	raidfuse::raid5 &raid = *array.raid;
+
+	for (const std::string &member: members)
+	{
+		array.drives.push_back(std::unique_ptr<raidfuse::drive>(new raidfuse::drive(member, options.writable)));
+		raid.add(*array.drives.back());
+	}
+	array.disk = &raid;
+
+	if (!array.name.empty())
+	{
+		std::cout << "[" << array.name << "]" << std::endl;
+	}
+	std::cout << "member size: " << array.drives.front()->size() << std::endl;
+
+	raid.recovery(options.retries, options.retry_size, std::chrono::milliseconds(10));
+	if (options.badblocks)
+	{
+		raid.badblocks().open(array_file(options.badblocks, array));
+		std::clog << "bad block list: " << raid.badblocks().count() << " ranges" << std::endl;
+	}
+
+	if (options.queue_depth)
+	{
+		raid.schedule(options.queue_depth, std::chrono::microseconds(options.queue_deadline));
+		for (size_t member = 0; member < raid.count(); member++)
+		{
+			raid.member_scheduler(member)->buffers().budget(&memory);
+		}
+	}
+
+	raid.buffers().hugepages(options.hugepages);
+	raid.buffers().budget(&memory);
+	raid.verify(options.verify);
+
+	if (options.journal)
+	{
+		raid.journal(array_file(options.journal, array));
+	}
+	else if (options.writable)
+	{
+		std::clog << "warning: writable without --journal, a crash while writing can leave parity stale without notice" << std::endl;
+	}
+
+	if (options.cache)
+	{
+		std::vector<raidfuse::drive *> members;
+		for (std::unique_ptr<raidfuse::drive> &drive: array.drives)
+		{
+			members.push_back(drive.get());
+		}
+		array.ssd.reset(new raidfuse::cache(*array.disk, members, array_file(options.cache, array), options.cache_size * 1024 * 1024));
+		array.disk = array.ssd.get();
+		std::clog << "cache: " << array.ssd->stats().used << " blocks cached" << std::endl;
+	}
+
+	if (options.overlay)
+	{
+		array.cow.reset(new raidfuse::overlay(*array.disk, array_file(options.overlay, array)));
+		array.disk = array.cow.get();
+		std::clog << "overlay: " << array.cow->used() << " chunks redirected" << std::endl;
+	}
+}
+
+/**
+ * @brief Print array geometry and partition table, find partition
+ */
+void probe(array_t &array)
+{
+	raidfuse::raid5 &raid = *array.raid;
+	raidfuse::interface::drive *disk = array.disk;
+
+	if (!array.name.empty())
+	{
+		std::cout << "[" << array.name << "]" << std::endl;
+	}
 
 	std::cout << "raid member count: " << raid.count() << std::endl;
 	std::cout << "raid physical size: " << raid.physical_size() << " Bytes" << std::endl;
 	std::cout << "raid logical size: " << raid.logical_size() << " Bytes" << std::endl;
 	std::cout << "raid physical LBA: " << raid.physical_lba() << " LBAs" << std::endl;
 	std::cout << "raid logical LBA: " << raid.logical_lba() << " LBAs" << std::endl;
+	std::cout << "raid block size: " << raid.logical_block_size() << " / " << raid.physical_block_size() << " Bytes" << std::endl;
+
+	/* Partition tables count in logical blocks, 4096 Bytes on 4Kn members */
+	size_t block_lba = disk->logical_block_size() / raidfuse::interface::drive::sector_size;
 
 	for (size_t physical_stripe = 0; physical_stripe < 48; physical_stripe++)
 	{
@@ -270,7 +1143,7 @@ int main(int argc, char** argv)
 	std::clog << "Checking MBR sector... " << std::flush;
 
 	raidfuse::mbr::mbr_t mbr;
-	if (!raid.read(0, (std::uint8_t *)&mbr))
+	if (!disk->read(0, (std::uint8_t *)&mbr))
 	{
 		throw std::runtime_error("MBR read error");
 	}
@@ -293,7 +1166,7 @@ int main(int argc, char** argv)
 	std::clog << "Checking GPT sector... " << std::flush;
 
 	raidfuse::gpt::header_t header;
-	if (!raid.read(1, (std::uint8_t *)&header))
+	if (!disk->read(block_lba, (std::uint8_t *)&header))
 	{
 		throw std::runtime_error("GPT header read error");
 	}
@@ -328,7 +1201,7 @@ int main(int argc, char** argv)
 	std::cout << std::endl;
 
 	raidfuse::gpt::entry_t entry[4];
-	if (!raid.read(2, (std::uint8_t *)entry))
+	if (!disk->read(header.partition_lba * block_lba, (std::uint8_t *)entry))
 	{
 		throw std::runtime_error("GPT entry read error");
 	}
@@ -346,7 +1219,7 @@ int main(int argc, char** argv)
 
 		if ((entry[i].start) && (entry[i].end))
 		{
-			part = new raidfuse::partition(raid, "partition", entry[i].start, entry[i].end);
+			array.part.reset(new raidfuse::partition(*disk, "partition", entry[i].start * block_lba, (entry[i].end + 1) * block_lba - 1));
 
 		/*
 			raidfuse::partition *partition = new raidfuse::partition(raid, "partition", entry[i].start, entry[i].end);
@@ -371,12 +1244,20 @@ int main(int argc, char** argv)
 #endif
 
 #ifdef EXT2
-	ext2_super_block block;
-	if (!raid.read(36, (std::uint8_t *)&block))
+	/* The superblock is at byte 1024 of the file system, read in whole logical blocks */
+	raidfuse::interface::drive *volume = array.part ? array.part.get() : disk;
+	size_t volume_block = volume->logical_block_size();
+	size_t first = SUPERBLOCK_OFFSET / volume_block * volume_block;
+	size_t last = (SUPERBLOCK_OFFSET + SUPERBLOCK_SIZE + volume_block - 1) / volume_block * volume_block;
+	std::vector<std::uint8_t> blocks(last - first);
+	if (volume->read(first / raidfuse::interface::drive::sector_size, blocks.size() / raidfuse::interface::drive::sector_size, &blocks[0]) != blocks.size())
 	{
 		throw std::runtime_error("EXT2 superblock read error");
 	}
 
+	ext2_super_block block;
+	memcpy(&block, &blocks[SUPERBLOCK_OFFSET - first], sizeof(block));
+
 	printf("Total inode count: %d\n", block.s_inodes_count);
 	printf("Total block count: %d\n", block.s_blocks_count);
 	printf("This number of blocks can only be allocated by the super-user: %d\n", block.s_r_blocks_count);
@@ -397,18 +1278,198 @@ int main(int argc, char** argv)
 	printf("Number of mounts beyond which a fsck is needed: %d\n", block.s_max_mnt_count);
 	printf("Magic = 0x%.4X\n", block.s_magic);
 #endif
+}
+
+/**
+ * @brief Snapshot of array in the file given by --snapshot
+ */
+raidfuse::snapshot array_snapshot(array_t &array)
+{
+	std::vector<raidfuse::interface::drive *> members;
+	for (std::unique_ptr<raidfuse::drive> &drive: array.drives)
+	{
+		members.push_back(drive.get());
+	}
+	return raidfuse::snapshot(array_file(options.snapshot, array), members, *array.disk, array.raid->stripe_size());
+}
 
+/**
+ * @brief Take partition from snapshot instead of probing
+ * @return false without matching snapshot
+ */
+bool restore(array_t &array, raidfuse::snapshot &snapshot)
+{
+	if (!snapshot.load())
+	{
+		std::clog << "snapshot: missing or stale, probing on first access" << std::endl;
+		return false;
+	}
+
+	size_t start, end;
+	if (snapshot.partition(start, end))
+	{
+		array.part.reset(new raidfuse::partition(*array.disk, "partition", start, end));
+	}
+	std::clog << "snapshot: restored" << std::endl;
+	return true;
+}
+
+/**
+ * @brief Save probed partition for the next mount
+ * @param snapshot as checked by restore(), probing does not change the fingerprints
+ */
+void remember(array_t &array, raidfuse::snapshot &snapshot)
+{
+	if (array.part)
+	{
+		snapshot.record_partition(array.part->start(), array.part->end());
+	}
+	snapshot.save();
+}
+
+/**
+ * @brief Probe array unless restored or probed before
+ *
+ * Called by the first access which needs the partition. A failed probe
+ * leaves the array without partition and is not saved to the snapshot.
+ */
+void probed(array_t &array)
+{
+	std::call_once(array.probed, [&array]()
+	{
+		try
+		{
+			probe(array);
+			if (array.snapshot)
+			{
+				remember(array, *array.snapshot);
+			}
+		}
+		catch (const std::exception &error)
+		{
+			std::clog << "probe: " << error.what() << std::endl;
+		}
+		array.snapshot.reset();
+	});
+}
+
+fuse_operations fuse_callback;
+
+int main(int argc, char** argv)
+{
+	export_options export_command;
+	if ((argc > 1) && ((strcmp(argv[1], "export") == 0) || (strcmp(argv[1], "rebuild") == 0)))
+	{
+		export_parse(argc - 1, argv + 1, export_command);
+	}
+
+	options.retries = 2;
+	options.cache_size = 1024;
+	options.queue_deadline = 50000;
+	options.retry_size = 4096;
+
+	fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	if (!export_command.active && (fuse_opt_parse(&args, &options, option_spec, NULL) == -1))
+	{
+		return EXIT_FAILURE;
+	}
+
+#ifdef RAID
+	const std::vector<std::string> members = { "/dev/sda", "/dev/sdb", "/dev/sdc", "/dev/sdd" };
+	if (export_command.rebuild)
+	{
+		return rebuild_run(members, export_command);
+	}
+
+	memory.limit(options.memory * 1024 * 1024);
+
+	if (options.config)
+	{
+		size_t count = 0;
+		for (const array_config_t &config: read_config(options.config))
+		{
+			arrays.push_back(std::unique_ptr<array_t>(new array_t()));
+			arrays.back()->name = config.name;
+			arrays.back()->index = arrays.size() - 1;
+			assemble(*arrays.back(), config.members, config.stripe);
+			count += config.members.size();
+		}
+
+		/* Arrays take turns once the mount is busy */
+		fairness.slots(options.threads ? options.threads : 2 * count);
+	}
+	else
+	{
+		arrays.push_back(std::unique_ptr<array_t>(new array_t()));
+		arrays.back()->index = 0;
+		assemble(*arrays.back(), members, 256 * 1024);
+	}
+
+	for (std::unique_ptr<array_t> &array: arrays)
+	{
+		if (export_command.active)
+		{
+			/* Export needs the partition right away, without saving it */
+			probe(*array);
+			std::call_once(array->probed, []() {});
+			continue;
+		}
+
+		if (!options.snapshot)
+		{
+			continue;
+		}
+
+		/* Fingerprints are read once, for checking and saving */
+		array->snapshot.reset(new raidfuse::snapshot(array_snapshot(*array)));
+		if (restore(*array, *array->snapshot))
+		{
+			array->snapshot.reset();
+			std::call_once(array->probed, []() {});
+		}
+	}
 #endif
+
+	if (export_command.active)
+	{
+		std::vector<std::string> names;
+		for (std::unique_ptr<array_t> &array: arrays)
+		{
+			names.insert(names.end(), array->members.begin(), array->members.end());
+		}
+		export_open(export_command, names);
+
+		array_t &array = *arrays.front();
+		if (export_command.partition)
+		{
+			if (!array.part)
+			{
+				throw std::runtime_error("export: no partition found");
+			}
+			return export_run(*array.part, export_command);
+		}
+		return export_run(*array.disk, export_command);
+	}
+
 	fuse_callback.getattr = raid_getattr;
 	fuse_callback.readdir = raid_readdir;
 	fuse_callback.open = raid_open;
 	fuse_callback.read = raid_read;
+	fuse_callback.init = raid_init;
+	/* Also read-only, the cache has to be written back and marked clean */
+	fuse_callback.destroy = raid_destroy;
+	if (options.writable || options.overlay)
+	{
+		fuse_callback.write = raid_write;
+		fuse_callback.truncate = raid_truncate;
+		fuse_callback.fsync = raid_fsync;
+	}
 
 /*
 	entries.push_back("disk");
 	entries.push_back("partition1");
 	entries.push_back("partition2");
 */
-	return fuse_main(argc, argv, &fuse_callback, NULL);
+	return fuse_main(args.argc, args.argv, &fuse_callback, NULL);
 //	return EXIT_SUCCESS;
 }